@@ -0,0 +1,149 @@
+#ifndef ALGEBRA_CPP
+#define ALGEBRA_CPP
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "set.h"
+
+// Bulk operations between two sets. Each one scans one set by slot ranges, a range per thread, and looks the values
+// up in the other set a batch at a time through contains_batch(). Scans have the weak consistency of
+// set<T>::for_each_range(), so sets that are being modified give a result that is correct for the values left alone.
+// size() counts every bucket on the cuckoo sets, so each operand's size is taken once per operation.
+class algebra {
+
+    private:
+
+        // Scan <scanned> with <threads> workers and hand each worker's values whose presence in <probed> equals <keep> to
+        // <emit>(thread, values, count)
+        template <typename T, typename Emit>
+        static void filter(set<T>& scanned, set<T>& probed, bool keep, int threads, Emit emit) {
+            size_t slots = scanned.buckets();
+            std::vector<std::thread> workers;
+
+            for (int t = 0; t < threads; t++) {
+                size_t begin = slots * t / threads;
+                size_t end = slots * (t + 1) / threads;
+
+                workers.push_back(std::thread([&, t, begin, end]() {
+                    T batch[set<T>::batch_size];
+                    bool found[set<T>::batch_size];
+                    T kept[set<T>::batch_size];
+                    int n = 0;
+
+                    auto flush = [&]() {
+                        probed.contains_batch(batch, n, found);
+
+                        int m = 0;
+                        for (int b = 0; b < n; b++) {
+                            if (found[b] == keep) {
+                                kept[m++] = batch[b];
+                            }
+                        }
+
+                        emit(t, kept, m);
+                        n = 0;
+                    };
+
+                    scanned.for_each_range(begin, end, [&](T value) {
+                        batch[n++] = value;
+
+                        if (n == set<T>::batch_size) {
+                            flush();
+                        }
+                    });
+
+                    flush();
+                }));
+            }
+
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        // Join per-thread results into one vector sized for them up front
+        template <typename T>
+        static std::vector<T> concatenate(std::vector<std::vector<T>>& parts) {
+            size_t total = 0;
+            for (auto& part : parts) {
+                total += part.size();
+            }
+
+            std::vector<T> values;
+            values.reserve(total);
+
+            for (auto& part : parts) {
+                values.insert(values.end(), part.begin(), part.end());
+            }
+
+            return values;
+        }
+
+    public:
+
+        // Values in both <a> and <b>. The smaller of the two is scanned and the larger probed.
+        template <typename T>
+        static std::vector<T> intersect(set<T>& a, set<T>& b, int threads = 1) {
+            size_t a_size = a.size();
+            size_t b_size = b.size();
+
+            set<T>& smaller = a_size <= b_size ? a : b;
+            set<T>& larger = a_size <= b_size ? b : a;
+
+            // The result is no larger than the smaller set, so reserve that much between the workers
+            std::vector<std::vector<T>> parts(threads);
+            for (auto& part : parts) {
+                part.reserve(std::min(a_size, b_size) / threads + set<T>::batch_size);
+            }
+
+            filter(smaller, larger, true, threads, [&parts](int t, const T* values, int count) {
+                parts[t].insert(parts[t].end(), values, values + count);
+            });
+
+            return concatenate(parts);
+        }
+
+        // Values in <a> that are not in <b>
+        template <typename T>
+        static std::vector<T> subtract(set<T>& a, set<T>& b, int threads = 1) {
+            size_t a_size = a.size();
+
+            std::vector<std::vector<T>> parts(threads);
+            for (auto& part : parts) {
+                part.reserve(a_size / threads + set<T>::batch_size);
+            }
+
+            filter(a, b, false, threads, [&parts](int t, const T* values, int count) {
+                parts[t].insert(parts[t].end(), values, values + count);
+            });
+
+            return concatenate(parts);
+        }
+
+        // Add every value of <from> to <into>, returning how many were new. Only the values the batched lookups found
+        // missing reach add(). With more than one thread <into> must be one of the concurrent sets.
+        template <typename T>
+        static size_t unite_into(set<T>& into, set<T>& from, int threads = 1) {
+            std::vector<size_t> added(threads, 0);
+
+            // Room for the worst case up front, so the adds don't grow <into> several times over part way through
+            into.reserve(into.size() + from.size());
+
+            filter(from, into, false, threads, [&into, &added](int t, const T* values, int count) {
+                for (int i = 0; i < count; i++) {
+                    added[t] += into.add(values[i]);
+                }
+            });
+
+            size_t total = 0;
+            for (size_t count : added) {
+                total += count;
+            }
+
+            return total;
+        }
+};
+
+#endif
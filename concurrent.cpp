@@ -3,10 +3,15 @@
 #include <iostream>
 #include <shared_mutex>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
 
 #include "set.h"
 
-template <typename T> class concurrent_set: public set<T> {
+// D is the number of tables and hash functions, see sequential_set
+template <typename T, int D = 2> class concurrent_set: public set<T> {
+
+    static_assert(D >= 2, "cuckoo hashing needs at least two tables");
 
     // Hashset entry holds both the value and a flag to determine if the entry currently holds a value. By default this flag is false.
     struct entry {
@@ -14,10 +19,51 @@ template <typename T> class concurrent_set: public set<T> {
         bool has_value;
     };
 
+    // The stripe locks covering a value's bucket in every table, held until this goes out of scope or is released
+    struct guard {
+        std::unique_lock<std::recursive_mutex> locks[D];
+
+        void release() {
+            for(int k = D - 1; k >= 0; k--) {
+                locks[k].unlock();
+            }
+        }
+    };
+
+    // Copy of the tables published for read-mostly mode, never modified once readers can see it. Each table is one
+    // flat array with bucket i at values[i * probe_size], holding counts[i] values. Counts are as wide as the probe
+    // size they have to reach, which --probe-size doesn't bound below 2^31.
+    struct version {
+        size_t size;
+        std::vector<T> values[D];
+        std::vector<uint32_t> counts[D];
+    };
+
+    // Epoch a reader is reading under, 0 when it isn't reading. Each reader has its own cache line, so announcing a
+    // read writes nothing another thread writes or reads on its own hot path.
+    struct alignas(64) reader_slot {
+        std::atomic<uint64_t> epoch;
+
+        reader_slot() : epoch(0) {}
+    };
+
+    // Threads that can read without locks at once, any more fall back to the stripes
+    static constexpr int max_readers = 256;
+
+    // Values are counted in a few shards by primary bucket, each on its own cache line, so the load check doesn't
+    // put every insertion on one shared counter. The shards are few enough to total whenever one looks full.
+    static constexpr int shards = 64;
+
+    struct alignas(64) shard_count {
+        std::atomic<size_t> values;
+
+        shard_count() : values(0) {}
+    };
+
     private:
 
-        // Current size of the hashset
-        int set_size;
+        // Current size of the hashset. Read without locks, a value's stripes depend on it so acquire() rechecks it.
+        std::atomic<size_t> set_size;
 
         // Lock table size
         int locks;
@@ -25,120 +71,211 @@ template <typename T> class concurrent_set: public set<T> {
         // The maximum amount of tries we should attempt before resizing the table
         int limit;
 
-        int probe_size = 4;
-        int threshold = 2;
+        // Capacity of each bucket, and the occupancy above which an insertion relocates values out of its bucket
+        int probe_size;
+        int threshold;
 
         // Tables which correspond to their appropriate hash functions
-        std::vector<std::vector<T>> tables[2];
+        std::vector<std::vector<T>> tables[D];
+
+        std::vector<std::recursive_mutex> lock_table[D];
+
+        shard_count filled[shards];
 
-        std::vector<std::recursive_mutex> lock_table[2];
+#ifdef SET_STATS
+        set_counters counters;
+#endif
+
+        // Read-mostly mode: writes made since the last publish before the next one goes out, 0 when the mode is off
+        size_t publish_batch;
+        std::atomic<size_t> pending;
+
+        // Version readers look values up in, and the versions it replaced with the epoch each was replaced in. A
+        // replaced version is freed once no reader is still reading under an earlier epoch.
+        std::atomic<version*> published;
+        std::vector<std::pair<version*, uint64_t>> retired;
+
+        std::atomic<uint64_t> epoch;
+        std::vector<reader_slot> readers;
+
+        // One publisher at a time, it also guards <retired>
+        std::mutex publishing;
 
         // Primary table
-        int hash0(int value) {
-            return value % set_size;
+        size_t hash0(T value) {
+            return (uint64_t) value % set_size;
         }
 
-        // Secondary table, same function plus an offset
-        int hash1(int value) {
-            uint x = value;
-            x = ((x >> 16) ^ x) * 0x45d9f3b;
-            x = ((x >> 16) ^ x) * 0x45d9f3b;
-            x = (x >> 16) ^ x;
-            return x % set_size;
-        }       
+        // Hash function for table k of <size> buckets, table 0 uses the primary hash and the others a per-table mix
+        size_t hash(int k, T value, size_t size) {
+            if (k == 0) {
+                return (uint64_t) value % size;
+            }
+
+            return set<T>::mix((uint64_t) value + (k - 1) * 0x9e3779b97f4a7c15ull) % size;
+        }
+
+        size_t hash(int k, T value) {
+            return hash(k, value, set_size);
+        }
+
+        // Bucket index of <value> in every table. The bucket headers are prefetched first and then the values they
+        // point to, so a lookup waits on the D misses of each step together instead of one after another.
+        void candidates(T value, size_t* index) {
+            for(int k = 0; k < D; k++) {
+                index[k] = hash(k, value);
+                __builtin_prefetch(&tables[k][index[k]]);
+            }
+
+            for(int k = 0; k < D; k++) {
+                __builtin_prefetch(tables[k][index[k]].data());
+            }
+        }
 
         void resize() {
-            // Track the old size, double the current
-            int size_old = set_size;
+            size_t size_old = set_size;
+            resize(size_old, set<T>::growth.next(size_old));
+        }
 
-            for(int i = 0; i < locks; i++) {
-                std::unique_lock<std::recursive_mutex> lock(lock_table[0][i]);
+        // Rebuild the tables at <size_new> buckets, unless they are no longer <size_old>
+        void resize(size_t size_old, size_t size_new) {
+            // Holding every stripe of every table keeps all other operations out until the tables are rebuilt. The
+            // table0 stripes alone would do for anything that goes through acquire(), but relocate() peeks at a
+            // bucket of another table under just that table's stripe. Taken in table order, like acquire().
+            std::vector<std::unique_lock<std::recursive_mutex>> held;
+            for(int k = 0; k < D; k++) {
+                for(int i = 0; i < locks; i++) {
+                    held.emplace_back(lock_table[k][i]);
+                }
             }
 
             if (size_old != set_size) {
-                // We didn't acquire locks in time
+                // Someone else resized while we waited for the locks
                 return;
             }
 
-            std::vector<std::vector<T>> table0_old = tables[0];
-            std::vector<std::vector<T>> table1_old = tables[1];
+#ifdef SET_STATS
+            uint64_t started = set_counters::now();
+#endif
 
-            set_size = size_old * 2;
+            std::vector<std::vector<T>> tables_old[D];
 
-            tables[0] = std::vector<std::vector<T>>(set_size);
-            tables[1] = std::vector<std::vector<T>>(set_size);
+            set_size = size_new;
 
-            for(int i = 0; i < set_size; i++) {
-                tables[0].push_back(std::vector<T>(probe_size));
-                tables[1].push_back(std::vector<T>(probe_size));
+            // Values map to new stripes, the reinsertions below count them again
+            for (auto& shard : filled) {
+                shard.values.store(0, std::memory_order_relaxed);
             }
 
-            // Copy over the old entries, but only the ones that had values
-            for(int i = 0; i < size_old; i++) {
-                for (auto it = table0_old[i].begin(); it != table0_old[i].end(); ++it) {
-					add(*it);
-				}
+            for(int k = 0; k < D; k++) {
+                tables_old[k] = std::move(tables[k]);
+                tables[k] = std::vector<std::vector<T>>(set_size);
 
-                for (auto it = table1_old[i].begin(); it != table1_old[i].end(); ++it) {
-					add(*it);
-				}
+                for(size_t i = 0; i < set_size; i++) {
+                    tables[k][i].reserve(probe_size);
+                }
             }
+
+            // Copy over the old entries, but only the ones that had values
+            for(int k = 0; k < D; k++) {
+                for(size_t i = 0; i < size_old; i++) {
+                    for (auto it = tables_old[k][i].begin(); it != tables_old[k][i].end(); ++it) {
+                        insert(*it);
+                    }
+                }
+            }
+
+#ifdef SET_STATS
+            counters.resize(set_counters::now() - started);
+#endif
         }
         
-        bool relocate(int i, int hi) {
-            int j = 1 - i;
-            int hj = 0;
+        // Move values out of the over-threshold bucket <hi> of table <i> into their alternate buckets until every bucket
+        // on the path is back under the threshold. Each value goes to the least loaded of its buckets in the other
+        // tables. Returns false if that fails within <limit> rounds.
+        bool relocate(int i, size_t hi) {
+            int j = 0;
+            size_t hj = 0;
 
-            for (int round = 0; round < limit; round++) {
-                T val = tables[i][hi].at(0);
+            int path = 0;
+            int round = 0;
 
-                if (i) {
-                    hj = hash0(val);
-                }
-                else {
-                    hj = hash1(val);
+            for (; round < limit; round++) {
+                // Peek at the oldest value in the bucket under the bucket's own stripe, then lock both of its stripes
+                T val;
+                {
+                    std::unique_lock<std::recursive_mutex> peek(lock_table[i][hi % locks]);
+
+                    if (tables[i][hi].empty()) {
+                        break;
+                    }
+
+                    val = tables[i][hi].at(0);
                 }
 
-                acquire(val);
+                guard held = acquire(val);
 
-                bool removed;
-                for (int i = 0; i < tables[i][hi].size(); ++i) {
-                    if (tables[i][hi].at(i) == val) {
-                        tables[i][hi].erase(tables[i][hi].begin() + i);
-                        removed = true;
-                        break;
+                if (hash(i, val) != hi) {
+                    // A resize rebuilt the tables since we were called, nothing left to relocate
+                    break;
+                }
+
+                // The guard holds the value's stripe in every table, so all of its buckets can be compared
+                j = -1;
+                for(int k = 0; k < D; k++) {
+                    if (k != i && (j < 0 || tables[k][hash(k, val)].size() < tables[j][hj].size())) {
+                        j = k;
+                        hj = hash(k, val);
                     }
                 }
 
-                if (removed) {
-                    if (tables[j][hj].size() < threshold) {
-                        tables[j][hj].push_back(val);
+                std::vector<T>& bucket_i = tables[i][hi];
+                std::vector<T>& bucket_j = tables[j][hj];
+
+                auto found = std::find(bucket_i.begin(), bucket_i.end(), val);
+
+                if (found != bucket_i.end()) {
+                    bucket_i.erase(found);
+                    path++;
+
+                    if (bucket_j.size() < threshold) {
+                        bucket_j.push_back(val);
+#ifdef SET_STATS
+                        counters.path(path);
+#endif
                         return true;
                     }
-                    else if (tables[j][hj].size() < probe_size) {
-                        tables[j][hj].push_back(val);
-                        i = 1 - i;
+                    else if (bucket_j.size() < probe_size) {
+                        bucket_j.push_back(val);
+                        i = j;
                         hi = hj;
-                        j = 1 - j;
                     }
                     else {
-                        tables[i][hi].push_back(val);
+                        bucket_i.push_back(val);
+#ifdef SET_STATS
+                        counters.path(path);
+#endif
                         return false;
                     }
                 }
-                else if (tables[i][hi].size() >= threshold) {
+                else if (bucket_i.size() >= threshold) {
                     continue;
                 }
                 else {
-                    return true;
+                    break;
                 }
             }
 
-            return false;
+#ifdef SET_STATS
+            counters.path(path);
+#endif
+
+            // We only run out of rounds if the path never ended
+            return round < limit;
         }
 
         // Swap a new entry, return the old one
-        entry swap(entry* table, T value, int index) {
+        entry swap(entry* table, T value, size_t index) {
             entry entry_old = table[index];
 
             table[index].value = value;
@@ -147,77 +284,278 @@ template <typename T> class concurrent_set: public set<T> {
             return entry_old;
         }
 
-        void acquire(T value) {
-            int l_index0 = hash0(value) % locks;
-            int l_index1 = hash1(value) % locks;
+        std::unique_lock<std::recursive_mutex> lock(int table, int stripe) {
+#ifdef SET_STATS
+            std::unique_lock<std::recursive_mutex> held(lock_table[table][stripe], std::try_to_lock);
 
-            std::unique_lock<std::recursive_mutex> lock0(lock_table[0][l_index0]);
-            std::unique_lock<std::recursive_mutex> lock1(lock_table[1][l_index1]);
+            if (held.owns_lock()) {
+                counters.lock(table * locks + stripe, false, 0);
+            }
+            else {
+                uint64_t started = set_counters::now();
+                held.lock();
+                counters.lock(table * locks + stripe, true, set_counters::now() - started);
+            }
+
+            return held;
+#else
+            return std::unique_lock<std::recursive_mutex>(lock_table[table][stripe]);
+#endif
         }
 
-    public:
+        // Insert a run of values with every stripe they need taken once, in table and then stripe order like acquire().
+        // Values that would need relocating or a resize can't be handled while holding stripes out of order, so they
+        // are left in <deferred> for add(). Returns how many values were added.
+        size_t insert_run(const T* values, size_t count, std::vector<T>& deferred) {
+            std::vector<std::unique_lock<std::recursive_mutex>> held = acquire_all(values, count);
 
-        concurrent_set(int size, int num_locks, int limit) {
-            this->set_size = size;
-            this->locks = num_locks;
-            this->limit = limit;
+            size_t added = 0;
+
+            for(size_t i = 0; i < count; i++) {
+                T value = values[i];
+
+                size_t index[D];
+                bool found = false;
+
+                for(int k = 0; k < D && !found; k++) {
+                    index[k] = hash(k, value);
+                    found = std::find(tables[k][index[k]].begin(), tables[k][index[k]].end(), value) != tables[k][index[k]].end();
+                }
+
+                if (found) {
+                    continue;
+                }
+
+                bool placed = false;
 
-            tables[0] = std::vector<std::vector<T>>(size);
-            tables[1] = std::vector<std::vector<T>>(size);
+                // Any bucket under the threshold takes the value outright
+                for(int k = 0; k < D && !placed; k++) {
+                    if (tables[k][index[k]].size() < threshold) {
+                        tables[k][index[k]].push_back(value);
+                        counted(value, 1);
+                        placed = true;
+                        added++;
+#ifdef SET_STATS
+                        counters.path(0);
+#endif
+                    }
+                }
 
-            for(int i = 0; i < set_size; i++) {
-                tables[0].push_back(std::vector<T>(probe_size));
-                tables[1].push_back(std::vector<T>(probe_size));
+                if (!placed) {
+                    deferred.push_back(value);
+                }
             }
 
-            std::vector<std::recursive_mutex> locks0(num_locks);
-            std::vector<std::recursive_mutex> locks1(num_locks);
+            return added;
+        }
+
+        // Lock the stripes of every value in <values>, each stripe once, in table and then stripe order like acquire()
+        std::vector<std::unique_lock<std::recursive_mutex>> acquire_all(const T* values, size_t count) {
+            for (;;) {
+                size_t size = set_size;
+
+                std::vector<size_t> stripes[D];
+                for(size_t i = 0; i < count; i++) {
+                    for(int k = 0; k < D; k++) {
+                        stripes[k].push_back(hash(k, values[i]) % locks);
+                    }
+                }
+
+                std::vector<std::unique_lock<std::recursive_mutex>> held;
+                for(int k = 0; k < D; k++) {
+                    std::sort(stripes[k].begin(), stripes[k].end());
+                    stripes[k].erase(std::unique(stripes[k].begin(), stripes[k].end()), stripes[k].end());
 
-            lock_table[0].swap(locks0);
-            lock_table[1].swap(locks1);
+                    for (size_t stripe : stripes[k]) {
+                        held.push_back(lock(k, stripe));
+                    }
+                }
+
+                // A resize moved the values' buckets while we were locking, start over
+                if (size == set_size) {
+                    return held;
+                }
+            }
         }
 
-        bool add(T value) {
-            acquire(value);
+        // The helpers below expect the caller to hold <value>'s stripes
 
-            // If the table already contains the value return false
-            if (contains(value)) {
+        bool present(T value) {
+            for(int k = 0; k < D; k++) {
+                std::vector<T>& bucket = tables[k][hash(k, value)];
+
+                if (std::find(bucket.begin(), bucket.end(), value) != bucket.end()) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Put <value> in a bucket under the threshold if it has one, otherwise in any with room, and report which.
+        // Returns false if all of its buckets are full.
+        bool place(T value, int& table, size_t& index) {
+            for(int pass = 0; pass < 2; pass++) {
+                for(int k = 0; k < D; k++) {
+                    std::vector<T>& bucket = tables[k][hash(k, value)];
+
+                    if (bucket.size() < (pass == 0 ? threshold : probe_size)) {
+                        bucket.push_back(value);
+                        counted(value, 1);
+                        table = k;
+                        index = hash(k, value);
+                        return true;
+                    }
+                }
+            }
+
+            return false;
+        }
+
+        bool take(T value) {
+            for(int k = 0; k < D; k++) {
+                std::vector<T>& bucket = tables[k][hash(k, value)];
+                auto found = std::find(bucket.begin(), bucket.end(), value);
+
+                if (found != bucket.end()) {
+                    bucket.erase(found);
+                    counted(value, -1);
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Track a value added (1) or removed (-1)
+        void counted(T value, int change) {
+            filled[hash0(value) % shards].values.fetch_add(change, std::memory_order_relaxed);
+        }
+
+        size_t counted() {
+            size_t count = 0;
+            for (auto& shard : filled) {
+                count += shard.values.load(std::memory_order_relaxed);
+            }
+
+            return count;
+        }
+
+        // Whether the set has passed the policy's maximum load. Only once <value>'s shard is past its share are the
+        // shards totalled, so one crowded shard doesn't grow the set on its own. Read without locks, a check racing
+        // a write or a resize sees a slightly stale count, which only moves growth by an insertion.
+        bool full(T value) {
+            if (set<T>::growth.max_load >= 1) {
                 return false;
             }
 
-            int index0 = hash0(value);
-            int index1 = hash1(value);
+            double limit = set<T>::growth.max_load * D * set_size * probe_size;
+            return filled[hash0(value) % shards].values.load(std::memory_order_relaxed) > limit / shards && counted() > limit;
+        }
 
-            bool to_resize = false;
+        // Grow once if any of <values> finds the set full. Called with no stripes held.
+        void grow_if_full(const T* values, size_t count) {
+            for(size_t i = 0; i < count; i++) {
+                if (full(values[i])) {
+                    resize();
+                    return;
+                }
+            }
+        }
 
-            int table_index = -1;
-            int hash_index = -1;
+        // Relocate out of the buckets a group operation left over the threshold, now that its stripes are released
+        void rebalance(const std::vector<std::pair<int, size_t>>& crowded) {
+            for (auto& bucket : crowded) {
+                if (!relocate(bucket.first, bucket.second)) {
+                    resize();
+                }
+            }
+        }
+
+        // Lock the stripes covering <value>, always in table order. A resize changes which buckets (and so which
+        // stripes) a value maps to, so if one happened while we waited we let go and try again.
+        guard acquire(T value) {
+            for (;;) {
+                size_t size = set_size;
+
+                guard held;
+                for(int k = 0; k < D; k++) {
+                    held.locks[k] = lock(k, hash(k, value) % locks);
+                }
 
-            if (tables[0][index0].size() < threshold) {
-                tables[0][index0].push_back(value);
-                return true;
+                if (size == set_size) {
+                    return held;
+                }
+            }
+        }
+
+        // Look <value> up in the tables themselves, under its stripes
+        bool find(T value) {
+            guard held = acquire(value);
+
+            size_t index[D];
+            candidates(value, index);
+
+            // Check if the value is in any of the tables
+            for(int k = 0; k < D; k++) {
+                for (auto it = tables[k][index[k]].begin(); it != tables[k][index[k]].end(); ++it) {
+                    if (*it == value) {
+                        return true;
+                    }
+                }
             }
-            else if (tables[1][index1].size() < threshold) {
-                tables[1][index1].push_back(value);
-                return true;
+
+            return false;
+        }
+
+        bool insert(T value) {
+            guard held = acquire(value);
+
+            // If the table already contains the value return false
+            if (find(value)) {
+                return false;
             }
-            else if (tables[0][index0].size() < probe_size) {
-                tables[0][index0].push_back(value);
-                table_index = 0;
-                hash_index = index0;
+
+            size_t index[D];
+            for(int k = 0; k < D; k++) {
+                index[k] = hash(k, value);
             }
-            else if (tables[1][index1].size() < probe_size) {
-                tables[1][index1].push_back(value);
-                table_index = 1;
-                hash_index = index1;
+
+            // Any bucket under the threshold takes the value outright
+            for(int k = 0; k < D; k++) {
+                if (tables[k][index[k]].size() < threshold) {
+                    tables[k][index[k]].push_back(value);
+                    counted(value, 1);
+#ifdef SET_STATS
+                    counters.path(0);
+#endif
+                    return true;
+                }
             }
-            else {
-                to_resize = true;
+
+            bool to_resize = true;
+
+            int table_index = -1;
+            size_t hash_index = 0;
+
+            // Otherwise the first with room takes it and gets relocated back under the threshold
+            for(int k = 0; k < D; k++) {
+                if (tables[k][index[k]].size() < probe_size) {
+                    tables[k][index[k]].push_back(value);
+                    counted(value, 1);
+                    table_index = k;
+                    hash_index = index[k];
+                    to_resize = false;
+                    break;
+                }
             }
+
+            // Relocating and resizing take their own locks, in order
+            held.release();
             
             if (to_resize) {
                 resize();
-                add(value);
+                insert(value);
             }
             else if (!relocate(table_index, hash_index)) {
                 resize();
@@ -226,70 +564,553 @@ template <typename T> class concurrent_set: public set<T> {
             return true;
         }
 
-        bool remove(T value){
-            acquire(value);
-            // Check if the value is in table0, if so, remove it
-            int index0 = hash0(value);
+        // Dense index for the calling thread into a set's reader slots, handed back when the thread exits so slots are
+        // reused across runs. -1 when every slot is taken.
+        static int reader_id() {
+            static std::atomic<bool> taken[max_readers];
 
-            for (auto it = tables[0][index0].begin(); it != tables[0][index0].end(); ++it) {
-                if (*it == value) {
-                    tables[0][index0].erase(it);
-                    return true;
+            struct registration {
+                int id = -1;
+
+                registration() {
+                    for(int i = 0; i < max_readers && id < 0; i++) {
+                        bool expected = false;
+                        if (taken[i].compare_exchange_strong(expected, true)) {
+                            id = i;
+                        }
+                    }
+                }
+
+                ~registration() {
+                    if (id >= 0) {
+                        taken[id].store(false);
+                    }
+                }
+            };
+
+            thread_local registration self;
+            return self.id;
+        }
+
+        // Look <values> up in the published version. The reader's slot announces the epoch it read the pointer
+        // under, which keeps that version from being freed until the reader is done with it.
+        void read(const T* values, int count, bool* found, int id) {
+            reader_slot& self = readers[id];
+
+            self.epoch.store(epoch.load());
+            version* v = published.load();
+
+            for(int b = 0; b < count; b++) {
+                for(int k = 0; k < D; k++) {
+                    __builtin_prefetch(&v->counts[k][hash(k, values[b], v->size)]);
+                    __builtin_prefetch(&v->values[k][(size_t) hash(k, values[b], v->size) * probe_size]);
+                }
+            }
+
+            for(int b = 0; b < count; b++) {
+                found[b] = false;
+
+                for(int k = 0; k < D && !found[b]; k++) {
+                    size_t i = hash(k, values[b], v->size);
+                    const T* bucket = &v->values[k][(size_t) i * probe_size];
+
+                    for(int j = 0; j < v->counts[k][i]; j++) {
+                        if (bucket[j] == values[b]) {
+                            found[b] = true;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            self.epoch.store(0, std::memory_order_release);
+        }
+
+        // Count <count> writes towards the next publish, and publish if they complete a batch. If another writer is
+        // already publishing we leave it to them, or to the next write.
+        void changed(size_t count) {
+            if (publish_batch == 0 || count == 0) {
+                return;
+            }
+
+            if (pending.fetch_add(count) + count >= publish_batch) {
+                std::unique_lock<std::mutex> publisher(publishing, std::try_to_lock);
+
+                if (publisher.owns_lock()) {
+                    publish_locked();
+                }
+            }
+        }
+
+        // Copy the tables into a new version, swap it in and free the versions no reader can still be using. Called
+        // with <publishing> held and no stripes.
+        void publish_locked() {
+            version* next = new version();
+
+            {
+                // Every table0 stripe keeps writers out, so the copy is of one consistent state
+                std::vector<std::unique_lock<std::recursive_mutex>> held;
+                for(int i = 0; i < locks; i++) {
+                    held.push_back(lock(0, i));
+                }
+
+                pending = 0;
+                next->size = set_size;
+
+                for(int k = 0; k < D; k++) {
+                    next->values[k].resize((size_t) next->size * probe_size);
+                    next->counts[k].resize(next->size);
+
+                    for(size_t i = 0; i < next->size; i++) {
+                        std::copy(tables[k][i].begin(), tables[k][i].end(), &next->values[k][(size_t) i * probe_size]);
+                        next->counts[k][i] = tables[k][i].size();
+                    }
                 }
             }
 
-            // Perform the same check for table1
-            int index1 = hash1(value);
-            for (auto it = tables[1][index1].begin(); it != tables[1][index1].end(); ++it) {
-                if (*it == value) {
-                    tables[1][index1].erase(it);
+            // A reader that sees the new epoch loaded its pointer after the swap, so only readers announcing an
+            // older epoch can still be in the version we replace
+            version* old = published.exchange(next);
+            uint64_t replaced = epoch.fetch_add(1) + 1;
+
+            if (old) {
+                retired.emplace_back(old, replaced);
+            }
+
+            uint64_t oldest = UINT64_MAX;
+            for (auto& reader : readers) {
+                uint64_t e = reader.epoch.load();
+
+                if (e != 0 && e < oldest) {
+                    oldest = e;
+                }
+            }
+
+            auto done = std::remove_if(retired.begin(), retired.end(), [oldest](std::pair<version*, uint64_t>& r) {
+                if (r.second <= oldest) {
+                    delete r.first;
                     return true;
                 }
+
+                return false;
+            });
+            retired.erase(done, retired.end());
+        }
+
+        size_t version_bytes(version* v) {
+            size_t bytes = sizeof(version);
+
+            for(int k = 0; k < D; k++) {
+                bytes += v->values[k].capacity() * sizeof(T) + v->counts[k].capacity() * sizeof(uint32_t);
             }
-            
-            return false;
+
+            return bytes;
         }
 
+    public:
+
+        // A <publish_batch> above 0 turns on read-mostly mode: lookups read a published copy of the tables without
+        // taking any locks, and writes reach that copy a batch of <publish_batch> at a time, or when publish() is
+        // called. Each publish copies the whole set, so it suits tables read far more often than they are written.
+        concurrent_set(size_t size, int num_locks, int limit, int probe_size = 4, int threshold = 2, size_t publish_batch = 0)
+            :
+#ifdef SET_STATS
+              counters(D * num_locks),
+#endif
+              pending(0), published(NULL), epoch(1)
+        {
+            this->set_size = size;
+            this->locks = num_locks;
+            this->limit = limit;
+            this->probe_size = probe_size;
+            this->threshold = threshold;
+
+            for(int k = 0; k < D; k++) {
+                tables[k] = std::vector<std::vector<T>>(size);
+
+                // Buckets start empty, with room for probe_size values
+                for(size_t i = 0; i < set_size; i++) {
+                    tables[k][i].reserve(probe_size);
+                }
+
+                std::vector<std::recursive_mutex> stripes(num_locks);
+                lock_table[k].swap(stripes);
+            }
+
+            this->publish_batch = publish_batch;
+
+            if (publish_batch > 0) {
+                readers = std::vector<reader_slot>(max_readers);
+                publish();
+            }
+        }
+
+        ~concurrent_set() {
+            delete published.load();
+
+            for (auto& r : retired) {
+                delete r.first;
+            }
+        }
+
+        bool add(T value) {
+            bool added = insert(value);
+
+            if (added) {
+                grow_if_full(&value, 1);
+            }
+
+            changed(added);
+            return added;
+        }
+
+        bool remove(T value){
+            bool removed = false;
+
+            {
+                guard held = acquire(value);
+
+                size_t index[D];
+                candidates(value, index);
+
+                // Check if the value is in any of the tables, if so, remove it
+                for(int k = 0; k < D && !removed; k++) {
+                    for (auto it = tables[k][index[k]].begin(); it != tables[k][index[k]].end(); ++it) {
+                        if (*it == value) {
+                            tables[k][index[k]].erase(it);
+                            counted(value, -1);
+                            removed = true;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            changed(removed);
+            return removed;
+        }
+
+        // In read-mostly mode this answers from the published version, so a write shows up only once its batch has
+        // been published
         bool contains(T value){
-            acquire(value);
-            // Check if the value is in table0
-            int index0 = hash0(value);
+            int id;
 
-            for (auto it = tables[0][index0].begin(); it != tables[0][index0].end(); ++it) {
-                if (*it == value) {
-                    return true;
+            if (publish_batch > 0 && (id = reader_id()) >= 0) {
+                bool found;
+                read(&value, 1, &found, id);
+                return found;
+            }
+
+            return find(value);
+        }
+
+        void contains_batch(const T* values, size_t count, bool* found) {
+            int id;
+
+            if (publish_batch > 0 && (id = reader_id()) >= 0) {
+                for(size_t begin = 0; begin < count; begin += set<T>::batch_size) {
+                    read(values + begin, std::min(count - begin, (size_t) set<T>::batch_size), found + begin, id);
                 }
+
+                return;
             }
 
-            // Perform the same check for table1
-            int index1 = hash1(value);
+            for(size_t begin = 0; begin < count; begin += set<T>::batch_size) {
+                int n = std::min(count - begin, (size_t) set<T>::batch_size);
 
-            for (auto it = tables[1][index1].begin(); it != tables[1][index1].end(); ++it) {
-                if (*it == value) {
-                    return true;
+                // The batch's stripes are taken together, which also keeps a resize from moving the tables while the
+                // bucket addresses are worked out, then the whole batch is prefetched before any probe
+                std::vector<std::unique_lock<std::recursive_mutex>> held = acquire_all(values + begin, n);
+
+                for(int b = 0; b < n; b++) {
+                    for(int k = 0; k < D; k++) {
+                        __builtin_prefetch(&tables[k][hash(k, values[begin + b])]);
+                    }
+                }
+
+                for(int b = 0; b < n; b++) {
+                    found[begin + b] = present(values[begin + b]);
                 }
             }
-            
-            return false;
         }
 
-        int size() {
-            int count = 0;
-            
-            // Iterate over both tables, add to count whenever we hit an element
-            for(int i = 0; i < set_size; i++) {
-                count += tables[0][i].size();
+        // Add every value of the group at once: other threads see none of them or all of them. The stripes of the whole
+        // group are held together, so a group that doesn't fit is taken back out, and added again after a resize.
+        // Returns how many values were new.
+        size_t add_all(const T* values, size_t count) {
+            std::vector<std::pair<int, size_t>> crowded;
+            size_t added = 0;
+
+            for (bool fits = false; !fits; ) {
+                std::vector<T> placed;
+                crowded.clear();
+                fits = true;
+
+                {
+                    std::vector<std::unique_lock<std::recursive_mutex>> held = acquire_all(values, count);
+
+                    for(size_t i = 0; i < count && fits; i++) {
+                        int table;
+                        size_t index;
+
+                        if (present(values[i])) {
+                            continue;
+                        }
 
-                count += tables[1][i].size();
+                        if (place(values[i], table, index)) {
+                            placed.push_back(values[i]);
+
+                            if (tables[table][index].size() > threshold) {
+                                crowded.push_back({table, index});
+                            }
+                        }
+                        else {
+                            fits = false;
+                        }
+                    }
+
+                    if (!fits) {
+                        for (T value : placed) {
+                            take(value);
+                        }
+                    }
+                }
+
+                if (!fits) {
+                    resize();
+                }
+
+                added = placed.size();
+            }
+
+            rebalance(crowded);
+            grow_if_full(values, count);
+            changed(added);
+            return added;
+        }
+
+        // Remove every value of the group at once. Returns how many were present.
+        size_t remove_all(const T* values, size_t count) {
+            size_t removed = 0;
+
+            {
+                std::vector<std::unique_lock<std::recursive_mutex>> held = acquire_all(values, count);
+
+                for(size_t i = 0; i < count; i++) {
+                    removed += take(values[i]);
+                }
+            }
+
+            changed(removed);
+            return removed;
+        }
+
+        // Swap <from> for <to> in one step, so no thread sees both or neither. Returns false, changing nothing, unless
+        // <from> is present and <to> isn't.
+        bool replace(T from, T to) {
+            T pair[2] = {from, to};
+            std::vector<std::pair<int, size_t>> crowded;
+
+            for (;;) {
+                {
+                    std::vector<std::unique_lock<std::recursive_mutex>> held = acquire_all(pair, 2);
+
+                    if (!present(from) || present(to)) {
+                        return false;
+                    }
+
+                    int table;
+                    size_t index;
+
+                    take(from);
+
+                    if (place(to, table, index)) {
+                        if (tables[table][index].size() > threshold) {
+                            crowded.push_back({table, index});
+                        }
+                        break;
+                    }
+
+                    // No room for <to>, put <from> back where it was found before growing
+                    place(from, table, index);
+                }
+
+                resize();
+            }
+
+            rebalance(crowded);
+            grow_if_full(&to, 1);
+            changed(2);
+            return true;
+        }
+
+        // Make every write so far visible to read-mostly lookups, without waiting for its batch to fill up
+        void publish() {
+            std::unique_lock<std::mutex> publisher(publishing);
+            publish_locked();
+        }
+
+        // Partitions the values by primary bucket range and inserts each partition with its stripes taken once
+        size_t insert_batch(const T* values, size_t count) {
+            std::vector<T> sorted;
+            std::vector<size_t> bounds;
+            std::vector<T> deferred;
+
+            size_t span = std::max((size_t) 1, set<T>::chunk_bytes / (sizeof(std::vector<T>) + probe_size * sizeof(T)));
+            // The runs are planned against one reading of the size, a resize meanwhile only makes them less local
+            size_t size = set_size;
+            set<T>::partition(values, count, size, span, [size, this](T value) { return hash(0, value, size); }, sorted, bounds);
+
+            size_t added = 0;
+            for(size_t r = 0; r + 1 < bounds.size(); r++) {
+                if (bounds[r] < bounds[r + 1]) {
+                    added += insert_run(&sorted[bounds[r]], bounds[r + 1] - bounds[r], deferred);
+                }
+            }
+
+            for (T value : deferred) {
+                added += insert(value);
+            }
+
+            grow_if_full(values, count);
+            changed(added);
+            return added;
+        }
+
+        size_t size() {
+            size_t count = 0;
+            
+            // Iterate over all tables, add to count whenever we hit an element
+            for(int k = 0; k < D; k++) {
+                for(size_t i = 0; i < set_size; i++) {
+                    count += tables[k][i].size();
+                }
             }
 
             return count;
         }
 
         // Generate random values until we've inserted pop items
-        void populate(int pop, T (*random_t)()) {
-            for(int i = 0; i < pop; i++) {
-                while(!add(random_t()));
+        void populate(size_t pop, T (*random_t)()) {
+            for(size_t i = 0; i < pop; i++) {
+                T value;
+                while(!insert(value = random_t()));
+                grow_if_full(&value, 1);
+            }
+
+            // The population goes out as one version rather than a batch at a time
+            if (publish_batch > 0) {
+                publish();
+            }
+        }
+
+        set_stats stats() {
+            set_stats s;
+            size_t count = 0;
+
+            s.occupancy = std::vector<uint64_t>(probe_size + 1);
+            for(int t = 0; t < D; t++) {
+                for(size_t i = 0; i < set_size; i++) {
+                    size_t held = tables[t][i].size();
+
+                    if (held >= s.occupancy.size()) {
+                        s.occupancy.resize(held + 1);
+                    }
+
+                    s.occupancy[held]++;
+                    count += held;
+                }
+            }
+
+            s.capacity = D * set_size * probe_size;
+            s.load_factor = (double) count / s.capacity;
+
+#ifdef SET_STATS
+            counters.fill(s);
+#endif
+
+            return s;
+        }
+
+        size_t memory_usage() {
+            size_t bytes = sizeof(*this);
+
+            for(int t = 0; t < D; t++) {
+                bytes += tables[t].capacity() * sizeof(std::vector<T>);
+
+                for (auto& bucket : tables[t]) {
+                    bytes += bucket.capacity() * sizeof(T);
+                }
+
+                bytes += lock_table[t].capacity() * sizeof(std::recursive_mutex);
+            }
+
+            if (publish_batch > 0) {
+                std::unique_lock<std::mutex> publisher(publishing);
+
+                bytes += version_bytes(published.load()) + readers.capacity() * sizeof(reader_slot);
+
+                for (auto& r : retired) {
+                    bytes += version_bytes(r.first);
+                }
+            }
+
+            return bytes;
+        }
+
+        // Buckets fill up to the threshold before insertions start relocating, so that is what the reservation
+        // plans for, or less if the policy's maximum load is lower
+        void reserve(size_t count) {
+            double load = std::min(set<T>::growth.max_load, (double) threshold / probe_size);
+            size_t size = set<T>::buckets_for(count, load, D * probe_size);
+
+            for (size_t current = set_size; current < size; current = set_size) {
+                resize(current, size);
+            }
+        }
+
+        bool grow() {
+            size_t count = counted();
+            size_t size = set_size;
+
+            if (set<T>::growth.idle_load <= 0 || count <= set<T>::growth.idle_load * D * size * probe_size) {
+                return false;
+            }
+
+            resize(size, set<T>::growth.next(size));
+            return true;
+        }
+
+        size_t buckets() {
+            return set_size;
+        }
+
+        void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) {
+            std::vector<T> slot;
+
+            for(size_t i = begin; i < end; i++) {
+                slot.clear();
+
+                {
+                    // Any table0 stripe keeps a resize out, then the slot's stripes in the other tables keep its
+                    // buckets still while we copy them
+                    guard held;
+                    for(int k = 0; k < D; k++) {
+                        held.locks[k] = lock(k, i % locks);
+                    }
+
+                    if (i >= set_size) {
+                        break;
+                    }
+
+                    for(int k = 0; k < D; k++) {
+                        slot.insert(slot.end(), tables[k][i].begin(), tables[k][i].end());
+                    }
+                }
+
+                for (T value : slot) {
+                    fn(value);
+                }
             }
         }
 };
\ No newline at end of file
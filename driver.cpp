@@ -4,6 +4,9 @@
 #include <thread> 
 #include <atomic>
 #include <random>
+#include <mutex>
+#include <iomanip>
+#include <algorithm>
 
 #include <getopt.h>
 #include <string.h>
@@ -11,26 +14,112 @@
 #include "sequential.cpp"
 #include "concurrent.cpp"
 #include "transactional.cpp"
+#include "shared.cpp"
+#include "robinhood.cpp"
+#include "hopscotch.cpp"
+#include "latency.cpp"
+#include "topology.cpp"
+#include "report.cpp"
+#include "trace.cpp"
+#include "perf.cpp"
+#include "algebra.cpp"
+#include "durable.cpp"
+
+// Keys the driver generates and stores. The sets take any integer type; 64-bit keys let --range go past 2^31.
+typedef int64_t value_t;
 
 enum implementation_t {
     sequential = 1,
     concurrent = 2,
-    transactional = 3
+    transactional = 3,
+    shared = 4,
+    robinhood = 5,
+    hopscotch = 6
 };
 
+enum arrival_t {
+    constant_arrivals = 1,
+    poisson_arrivals = 2
+};
+
+// Options that only have a long form
+enum long_option_t {
+    slo_option = 256,
+    affinity_option,
+    numa_option,
+    mix_option,
+    chunk_option,
+    warmup_option,
+    trials_option,
+    sweep_threads_option,
+    sweep_load_option,
+    sweep_implementations_option,
+    format_option,
+    output_option,
+    threshold_option,
+    record_option,
+    replay_option,
+    perf_option,
+    limit_option,
+    probe_size_option,
+    probe_threshold_option,
+    tune_limit_option,
+    tune_probe_size_option,
+    tune_probe_threshold_option,
+    tables_option,
+    scan_option,
+    segment_option,
+    read_mostly_option,
+    log_option,
+    group_option,
+    max_load_option,
+    growth_option,
+    idle_load_option,
+    reserve_option
+};
+
+enum format_t {
+    text_format = 0,
+    csv_format = 1,
+    json_format = 2
+};
+
+static const char* implementation_names[] = {"", "sequential", "concurrent", "transactional", "shared", "robinhood", "hopscotch"};
+
+// Returns 0 for an unknown implementation name
+implementation_t parse_implementation(const char* name) {
+    for (int i = sequential; i <= hopscotch; i++) {
+        if (!strcmp(name, implementation_names[i])) {
+            return (implementation_t) i;
+        }
+    }
+
+    return (implementation_t) 0;
+}
+
+// Implementations that aren't thread safe and always run with a single worker
+bool single_threaded(implementation_t implementation) {
+    return implementation == sequential || implementation == robinhood;
+}
+
+// Implementations with multi-value cuckoo buckets, the only ones the probe size and threshold apply to
+bool bucketed(implementation_t implementation) {
+    return implementation == concurrent || implementation == transactional || implementation == shared;
+}
+
 struct config {
 
     // Maximum key size
-    int range;
+    value_t range;
 
     // Initial table size
-    int size;
+    long size;
 
     // Number of items to populate the table with
-    int population;
+    long population;
 
     // Number of operations to run
-    int operations;
+    long operations;
 
     // The number of threads for which a test should run
     int threads;
@@ -41,9 +130,97 @@ struct config {
     // Number of locks to use for concurrent striping implementations
     int locks;
 
-    // Imlementation to run (sequential, concurrent, transactional)
+    // Imlementation to run (sequential, concurrent, transactional, shared, robinhood, hopscotch)
     implementation_t implementation;
 
+    // Cuckoo parameters: displacement rounds before resizing, and for the bucketed sets the bucket capacity and the
+    // occupancy above which an insertion starts relocating
+    int limit;
+    int probe_size;
+    int probe_threshold;
+
+    // Number of cuckoo tables and hash functions, each supported count is a separate instantiation
+    int tables;
+
+    // Threads for a background scanner that snapshots the set over and over while the workers run, 0 disables
+    int scan;
+
+    // Shared-memory segment for the shared implementation. Created and populated if it doesn't exist, otherwise
+    // attached as is. Empty uses a private segment that goes away with the process.
+    std::string segment;
+
+    // Concurrent set in read-mostly mode, publishing its writes to lock-free readers this many at a time. 0 disables.
+    int read_mostly;
+
+    // Recovery: directory for the operation log and checkpoints, empty uses a temporary one removed afterwards
+    std::string log;
+
+    // Multi-key workload: values per add_all and remove_all group
+    int group;
+
+    // When the sets grow and by how much, see growth_policy
+    growth_policy growth;
+
+    // Size the set for the population before populating it, instead of growing as it fills
+    bool reserve;
+
+    // Target aggregate throughput in operations per second, 0 runs closed-loop
+    double rate;
+
+    // Inter-arrival distribution for open-loop runs
+    arrival_t arrival;
+
+    // Sweep target rates to find the saturation point of the implementation
+    bool sweep;
+
+    // 99th percentile latency bound in microseconds a rate must meet to count as sustainable, 0 disables
+    int slo;
+
+    // Thread placement policy, and the cpus to use when an explicit list was given
+    affinity_t affinity;
+    std::vector<int> cpu_list;
+
+    // Where the table memory is allocated
+    memory_t memory;
+
+    // Seconds a time-bounded run lasts, 0 runs the fixed operation count instead
+    double duration;
+
+    // Operations claimed at a time from the shared workload, 0 gives each thread a fixed equal share
+    int chunk;
+
+    // Percentage of operations that are adds and removes, the rest are contains
+    int mix_add;
+    int mix_remove;
+
+    // Harness: discarded warm-up runs and measured trials per configuration
+    int warmup;
+    int trials;
+
+    // Harness: values to sweep over, empty means just the single value configured above
+    std::vector<int> sweep_threads;
+    std::vector<double> sweep_load;
+    std::vector<implementation_t> sweep_implementations;
+
+    // Harness: how results are written, and where ("" for stdout)
+    format_t format;
+    std::string output;
+
+    // Compare: percentage drop in throughput that counts as a regression
+    double threshold;
+
+    // Trace file to write the generated workload to, or to replay instead of generating one
+    std::string record;
+    std::string replay;
+
+    // Read hardware performance counters around the measured region
+    bool perf;
+
+    // Tuner: cuckoo parameter values to try
+    std::vector<int> tune_limit;
+    std::vector<int> tune_probe_size;
+    std::vector<int> tune_probe_threshold;
+
     config() {
         range = INT32_MAX;
         size = pow(2, 21);
@@ -53,18 +230,67 @@ struct config {
         seed = rand();
         locks = (size / 8);
         implementation = sequential;
+        limit = 1000;
+        probe_size = 4;
+        probe_threshold = 2;
+        tables = 2;
+        scan = 0;
+        read_mostly = 0;
+        group = 4;
+        reserve = false;
+        rate = 0;
+        arrival = poisson_arrivals;
+        sweep = false;
+        slo = 0;
+        affinity = no_affinity;
+        memory = first_touch_memory;
+        duration = 0;
+        chunk = 0;
+        mix_add = 10;
+        mix_remove = 10;
+        warmup = 1;
+        trials = 5;
+        format = text_format;
+        threshold = 5;
+        perf = false;
     }
 };
 
 struct results {
-    std::atomic<int> add_true;
-    std::atomic<int> add_false;
+    std::atomic<long> add_true;
+    std::atomic<long> add_false;
+
+    // Adds a shared set turned away for lack of room. They are taken out of add_false, which would otherwise pass
+    // them off as values already present.
+    std::atomic<long> add_rejected;
+
+    std::atomic<long> remove_true;
+    std::atomic<long> remove_false;
+
+    std::atomic<long> contains_true;
+    std::atomic<long> contains_false;
+
+    // Latency from intended start, only recorded by open-loop runs
+    latency_histogram latency;
+
+    // Hardware counters summed over the workers, when requested
+    perf_totals perf;
+
+    // Guards merging the per-thread latency and perf data above
+    std::mutex merge_lock;
+
+    // Size of the set at the end of the run
+    long set_size;
 
-    std::atomic<int> remove_true;
-    std::atomic<int> remove_false;
+    // The set's internals at the end of the run
+    set_stats stats;
+    size_t memory;
 
-    std::atomic<int> contains_true;
-    std::atomic<int> contains_false;
+    // Snapshots the background scanner completed during the run and their total time in microseconds, and the size
+    // of a snapshot taken once the workers were done
+    int scans;
+    long scan_time;
+    long snapshot_size;
 
     results() {
         contains_true = 0;
@@ -72,37 +298,219 @@ struct results {
 
         add_true = 0;
         add_false = 0;
+        add_rejected = 0;
 
         remove_true = 0;
         remove_false = 0;
+
+        set_size = 0;
+        memory = 0;
+
+        scans = 0;
+        scan_time = 0;
+        snapshot_size = 0;
     }
 };
 
+// Per-thread tallies, published to the shared results once a worker finishes
+struct counters {
+    long add_true = 0;
+    long add_false = 0;
+
+    long remove_true = 0;
+    long remove_false = 0;
+
+    long contains_true = 0;
+    long contains_false = 0;
+};
+
 void parseargs(int argc, char** argv, config& cfg) {
+    static const struct option long_options[] = {
+        {"range",          required_argument, NULL, 'r'},
+        {"size",           required_argument, NULL, 's'},
+        {"population",     required_argument, NULL, 'p'},
+        {"operations",     required_argument, NULL, 'o'},
+        {"threads",        required_argument, NULL, 't'},
+        {"seed",           required_argument, NULL, 'x'},
+        {"locks",          required_argument, NULL, 'l'},
+        {"implementation", required_argument, NULL, 'i'},
+        {"rate",           required_argument, NULL, 'R'},
+        {"arrival",        required_argument, NULL, 'a'},
+        {"sweep",          no_argument,       NULL, 'S'},
+        {"slo",            required_argument, NULL, slo_option},
+        {"affinity",       required_argument, NULL, affinity_option},
+        {"numa",           required_argument, NULL, numa_option},
+        {"mix",            required_argument, NULL, mix_option},
+        {"duration",       required_argument, NULL, 'd'},
+        {"chunk",          required_argument, NULL, chunk_option},
+        {"warmup",         required_argument, NULL, warmup_option},
+        {"trials",         required_argument, NULL, trials_option},
+        {"sweep-threads",  required_argument, NULL, sweep_threads_option},
+        {"sweep-load",     required_argument, NULL, sweep_load_option},
+        {"sweep-impl",     required_argument, NULL, sweep_implementations_option},
+        {"format",         required_argument, NULL, format_option},
+        {"output",         required_argument, NULL, output_option},
+        {"threshold",      required_argument, NULL, threshold_option},
+        {"record",         required_argument, NULL, record_option},
+        {"replay",         required_argument, NULL, replay_option},
+        {"perf",           no_argument,       NULL, perf_option},
+        {"limit",          required_argument, NULL, limit_option},
+        {"probe-size",     required_argument, NULL, probe_size_option},
+        {"probe-threshold", required_argument, NULL, probe_threshold_option},
+        {"tune-limit",     required_argument, NULL, tune_limit_option},
+        {"tune-probe-size", required_argument, NULL, tune_probe_size_option},
+        {"tune-probe-threshold", required_argument, NULL, tune_probe_threshold_option},
+        {"tables",         required_argument, NULL, tables_option},
+        {"scan",           required_argument, NULL, scan_option},
+        {"segment",        required_argument, NULL, segment_option},
+        {"read-mostly",    required_argument, NULL, read_mostly_option},
+        {"log",            required_argument, NULL, log_option},
+        {"group",          required_argument, NULL, group_option},
+        {"max-load",       required_argument, NULL, max_load_option},
+        {"growth",         required_argument, NULL, growth_option},
+        {"idle-load",      required_argument, NULL, idle_load_option},
+        {"reserve",        no_argument,       NULL, reserve_option},
+        {NULL,             0,                 NULL, 0}
+    };
+
     int opt;
-    while ((opt = getopt(argc, argv, "r:s:p:o:t:x:l:i:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "r:s:p:o:t:x:l:i:R:a:Sd:", long_options, NULL)) != -1) {
         switch (opt) {
-            case 'r': cfg.range = atoi(optarg); break;
-            case 's': cfg.size = atoi(optarg); break;
-            case 'p': cfg.population = atoi(optarg); break;
-            case 'o': cfg.operations = atoi(optarg); break;
+            case 'r': cfg.range = atoll(optarg); break;
+            case 's': cfg.size = atol(optarg); break;
+            case 'p': cfg.population = atol(optarg); break;
+            case 'o': cfg.operations = atol(optarg); break;
             case 't': cfg.threads = atoi(optarg); break;
             case 'x': cfg.seed = atoi(optarg); break;
             case 'l': cfg.locks = atoi(optarg); break;
             case 'i':
-                if (!strcmp(optarg, "sequential")) {
-                    cfg.implementation = sequential;
+                cfg.implementation = parse_implementation(optarg);
+                if (!cfg.implementation) {
+                    std::cout << "Available implementations are: 'sequential', 'concurrent', 'transactional', 'shared', 'robinhood', or 'hopscotch'" << std::endl;
+                    exit(1);
+                }; 
+                break;
+            case 'R': cfg.rate = atof(optarg); break;
+            case 'a':
+                if (!strcmp(optarg, "constant")) {
+                    cfg.arrival = constant_arrivals;
+                }
+                else if (!strcmp(optarg, "poisson")) {
+                    cfg.arrival = poisson_arrivals;
+                }
+                else {
+                    std::cout << "Available arrival processes are: 'constant' or 'poisson'" << std::endl;
+                    exit(1);
+                };
+                break;
+            case 'S': cfg.sweep = true; break;
+            case 'd': cfg.duration = atof(optarg); break;
+            case chunk_option: cfg.chunk = atoi(optarg); break;
+            case warmup_option: cfg.warmup = atoi(optarg); break;
+            case trials_option: cfg.trials = atoi(optarg); break;
+            case sweep_threads_option: cfg.sweep_threads = topology::parse_list(optarg); break;
+            case sweep_load_option:
+            {
+                std::stringstream list(optarg);
+                std::string load;
+                while (std::getline(list, load, ',')) {
+                    cfg.sweep_load.push_back(atof(load.c_str()));
+                }
+                break;
+            }
+            case sweep_implementations_option:
+            {
+                std::stringstream list(optarg);
+                std::string name;
+                while (std::getline(list, name, ',')) {
+                    implementation_t implementation = parse_implementation(name.c_str());
+                    if (!implementation) {
+                        std::cout << "Unknown implementation '" << name << "'" << std::endl;
+                        exit(1);
+                    }
+                    cfg.sweep_implementations.push_back(implementation);
+                }
+                break;
+            }
+            case format_option:
+                if (!strcmp(optarg, "text")) {
+                    cfg.format = text_format;
                 }
-                else if (!strcmp(optarg, "concurrent")) {
-                    cfg.implementation = concurrent;
+                else if (!strcmp(optarg, "csv")) {
+                    cfg.format = csv_format;
                 }
-                else if (!strcmp(optarg, "transactional")) {
-                    cfg.implementation = transactional;
+                else if (!strcmp(optarg, "json")) {
+                    cfg.format = json_format;
                 }
                 else {
-                    std::cout << "Available implementations are: 'sequential', 'concurrent', or 'transactional'" << std::endl;
+                    std::cout << "Available formats are: 'text', 'csv', or 'json'" << std::endl;
                     exit(1);
-                }; 
+                };
+                break;
+            case output_option: cfg.output = optarg; break;
+            case threshold_option: cfg.threshold = atof(optarg); break;
+            case record_option: cfg.record = optarg; break;
+            case replay_option: cfg.replay = optarg; break;
+            case perf_option: cfg.perf = true; break;
+            case limit_option: cfg.limit = atoi(optarg); break;
+            case probe_size_option: cfg.probe_size = atoi(optarg); break;
+            case probe_threshold_option: cfg.probe_threshold = atoi(optarg); break;
+            case tune_limit_option: cfg.tune_limit = topology::parse_list(optarg); break;
+            case tune_probe_size_option: cfg.tune_probe_size = topology::parse_list(optarg); break;
+            case tune_probe_threshold_option: cfg.tune_probe_threshold = topology::parse_list(optarg); break;
+            case tables_option: cfg.tables = atoi(optarg); break;
+            case scan_option: cfg.scan = atoi(optarg); break;
+            case segment_option: cfg.segment = optarg; break;
+            case read_mostly_option: cfg.read_mostly = atoi(optarg); break;
+            case log_option: cfg.log = optarg; break;
+            case group_option: cfg.group = atoi(optarg); break;
+            case max_load_option: cfg.growth.max_load = atof(optarg); break;
+            case growth_option: cfg.growth.factor = atof(optarg); break;
+            case idle_load_option: cfg.growth.idle_load = atof(optarg); break;
+            case reserve_option: cfg.reserve = true; break;
+            case slo_option: cfg.slo = atoi(optarg); break;
+            case affinity_option:
+                if (!strcmp(optarg, "none")) {
+                    cfg.affinity = no_affinity;
+                }
+                else if (!strcmp(optarg, "compact")) {
+                    cfg.affinity = compact_affinity;
+                }
+                else if (!strcmp(optarg, "scatter")) {
+                    cfg.affinity = scatter_affinity;
+                }
+                else if (isdigit(optarg[0])) {
+                    cfg.affinity = list_affinity;
+                    cfg.cpu_list = topology::parse_list(optarg);
+                }
+                else {
+                    std::cout << "Available affinities are: 'none', 'compact', 'scatter', or a cpu list such as '0,2,4-7'" << std::endl;
+                    exit(1);
+                };
+                break;
+            case numa_option:
+                if (!strcmp(optarg, "first-touch")) {
+                    cfg.memory = first_touch_memory;
+                }
+                else if (!strcmp(optarg, "interleave")) {
+                    cfg.memory = interleaved_memory;
+                }
+                else if (!strcmp(optarg, "local")) {
+                    cfg.memory = local_memory;
+                }
+                else if (!strcmp(optarg, "replicate")) {
+                    cfg.memory = replicated_memory;
+                }
+                else {
+                    std::cout << "Available memory placements are: 'first-touch', 'interleave', 'local', or 'replicate'" << std::endl;
+                    exit(1);
+                };
+                break;
+            case mix_option:
+                if (sscanf(optarg, "%d:%d", &cfg.mix_add, &cfg.mix_remove) != 2 || cfg.mix_add < 0 || cfg.mix_remove < 0 || cfg.mix_add + cfg.mix_remove > 100) {
+                    std::cout << "The operation mix is given as add:remove percentages, e.g. '10:10'" << std::endl;
+                    exit(1);
+                };
                 break;
         }
     }
@@ -112,222 +520,1572 @@ void parseargs(int argc, char** argv, config& cfg) {
 std::default_random_engine generator;
 
 // Uniform distributions for both the value and operation workload generation
-std::uniform_int_distribution<int> value_distribution;
+std::uniform_int_distribution<value_t> value_distribution;
 std::uniform_int_distribution<int> operation_distribution;
 
 
-std::vector<std::vector<char>> op_distributions(config cfg) {
-    std::vector<std::vector<char>> dists;
-    for (int t = 0; t < cfg.threads; t++) {
-        std::vector<char> dist;
+// One workload shared by all threads, each worker runs its own slice of it (or claims chunks of it)
+std::vector<char> op_distributions(config cfg) {
+    std::vector<char> dist;
+    dist.reserve(cfg.operations);
 
-        int opcount = 2 * (cfg.operations / cfg.threads);
-        for (int i = 0; i < opcount; ++i) {
-            int op = operation_distribution(generator);
+    for (long i = 0; i < cfg.operations; ++i) {
+        int op = operation_distribution(generator);
 
-            if (op < 10) {
-                dist.push_back('a');
-            } else if (op < 20) {
-                dist.push_back('r');
-            } else if (op < 100) {
-                dist.push_back('c');
-            }
+        if (op < cfg.mix_add) {
+            dist.push_back('a');
+        } else if (op < cfg.mix_add + cfg.mix_remove) {
+            dist.push_back('r');
+        } else if (op < 100) {
+            dist.push_back('c');
         }
+    }
 
-        dists.push_back(dist);
+    return dist;
+}
+
+std::vector<int64_t> val_distributions(config cfg) {
+    std::vector<int64_t> dist;
+    dist.reserve(cfg.operations);
+
+    for (long i = 0; i < cfg.operations; ++i) {
+        dist.push_back(value_distribution(generator));
     }
-    return dists;
+
+    return dist;
 }
 
-std::vector<std::vector<int>> val_distributions(config cfg) {
-    std::vector<std::vector<int>> dists;
-    for (int t = 0; t < cfg.threads; t++) {
-        std::vector<int> dist;
+// Aggregate arrival times in nanoseconds for a workload recorded at a target rate
+std::vector<uint64_t> arrival_distributions(config cfg) {
+    std::vector<uint64_t> times;
+    times.reserve(cfg.operations);
 
-        int opcount = 2 * (cfg.operations / cfg.threads);
-        for (int i = 0; i < opcount; ++i) {
-            int op = value_distribution(generator);
+    std::exponential_distribution<double> gap(cfg.rate);
+    double offset = 0;
 
-            dist.push_back(op);
-        }
-    
-        dists.push_back(dist);
+    for (long i = 0; i < cfg.operations; ++i) {
+        offset += cfg.arrival == poisson_arrivals ? gap(generator) : 1.0 / cfg.rate;
+        times.push_back(offset * 1e9);
     }
-    return dists;
+
+    return times;
 }
 
-int random_int() {
+value_t random_value() {
     return value_distribution(generator);
 }
 
-std::atomic<int> total_operations;
+// Next unclaimed operation when workers claim chunks of the workload, on its own cache line
+alignas(64) std::atomic<long> claimed_operations;
+
+// Raised by main once a time-bounded run is over
+alignas(64) std::atomic<bool> stop_workers;
+
+// Bounds of the slice of the workload owned by a thread
+long slice_begin(config &cfg, int thread_id) {
+    return cfg.operations * thread_id / cfg.threads;
+}
+
+long slice_end(config &cfg, int thread_id) {
+    return cfg.operations * (thread_id + 1) / cfg.threads;
+}
 
-void do_work(set<int>* int_set, results &res, config cfg, std::vector<char> &op_dist, std::vector<int> &val_dist) {
+long completed(results &res) {
+    return (long) res.add_true + res.add_false + res.add_rejected + res.remove_true + res.remove_false + res.contains_true + res.contains_false;
+}
 
-	auto op_iter = op_dist.begin();
-	auto val_iter = val_dist.begin();
+// Run a single operation against the set and tally its outcome
+void execute(set<value_t>* int_set, char op, value_t value, counters &local) {
+    switch (op) {
+        case 'a':
+        {
+            if(int_set->add(value)) {
+                local.add_true++;
+            } else {
+                local.add_false++;
+            }
 
-    int add_true = 0;
-    int add_false = 0;
+            break;
+        }
 
-    int remove_true = 0;
-    int remove_false = 0;
+        case 'r':
+        {
+            if(int_set->remove(value)) {
+                local.remove_true++;
+            } else {
+                local.remove_false++;
+            }
 
-    int contains_true = 0;
-    int contains_false = 0;
+            break;
+        }
 
-	while(++total_operations < cfg.operations + 1) {
-		switch (*op_iter) {
-			case 'a':
-			{
-                //std::cout << "a : " << *val_iter << std::endl;
-                if(int_set->add(*val_iter)) {
-                    add_true++;
-                } else {
-                    add_false++;
-                }
+        case 'c':
+        {
+            if(int_set->contains(value)) {
+                local.contains_true++;
+            } else {
+                local.contains_false++;
+            }
 
-				break;
-			}
+            break;
+        }
 
-			case 'r':
-			{
-                //std::cout << "r : " << *val_iter << std::endl;
-                if(int_set->remove(*val_iter)) {
-                    remove_true++;
-                } else {
-                    remove_false++;
-                }
-                
-				break;
-			}
-
-            case 'c':
-			{
-                //std::cout << "c : " << *val_iter << std::endl;
-                if(int_set->contains(*val_iter)) {
-                    contains_true++;
-                } else {
-                    contains_false++;
-                }
-                
-				break;
-			}
-			
-			default:
-				break;
-		}
+        default:
+            break;
+    }
+}
 
-        val_iter++;
-		op_iter++;
-	}
+void publish_perf(results &res, perf_counters &perf) {
+    perf.stop();
+
+    if (perf.active()) {
+        std::lock_guard<std::mutex> lock(res.merge_lock);
+        perf.collect(res.perf);
+    }
+}
+
+void publish(results &res, counters &local) {
+    res.add_true += local.add_true;
+    res.add_false += local.add_false;
+
+    res.remove_true += local.remove_true;
+    res.remove_false += local.remove_false;
+
+    res.contains_true += local.contains_true;
+    res.contains_false += local.contains_false;
+}
+
+void do_work(set<value_t>* int_set, results &res, config cfg, int thread_id, const workload &w) {
 
-    res.add_true += add_true;
-    res.add_false += add_false;
+    long begin = slice_begin(cfg, thread_id);
+    long end = slice_end(cfg, thread_id);
 
-    res.remove_true += remove_true;
-    res.remove_false += remove_false;
+    counters local;
+    perf_counters perf(cfg.perf);
+
+    if (cfg.duration > 0) {
+        // Cycle through our slice until the run is called off
+        for (long i = begin; begin < end && !stop_workers.load(std::memory_order_relaxed); i = (i + 1 < end) ? i + 1 : begin) {
+            execute(int_set, w.ops[i], w.keys[i], local);
+        }
+    }
+    else if (cfg.chunk > 0) {
+        // Claim the workload a chunk at a time so the shared counter is touched once per <chunk> operations
+        long first;
+        while ((first = claimed_operations.fetch_add(cfg.chunk, std::memory_order_relaxed)) < cfg.operations) {
+            long last = std::min(first + cfg.chunk, cfg.operations);
+
+            for (long i = first; i < last; i++) {
+                execute(int_set, w.ops[i], w.keys[i], local);
+            }
+        }
+    }
+    else {
+        for (long i = begin; i < end; i++) {
+            execute(int_set, w.ops[i], w.keys[i], local);
+        }
+    }
 
-    res.contains_true += contains_true;
-    res.contains_false += contains_false;
+    publish_perf(res, perf);
+    publish(res, local);
 
     return;
 }
 
-int main(int argc, char** argv) {
+// Wait for an open-loop operation's intended start. Sleep while it is far off and spin for the last stretch to keep the
+// schedule tight. The hardware counters are stopped meanwhile, so they only count the operations.
+void wait_until(std::chrono::steady_clock::time_point intended, perf_counters &perf) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= intended) {
+        return;
+    }
 
-    const int limit = 1000;
+    if (perf.active()) {
+        perf.stop();
+    }
 
-    config cfg;
-    parseargs(argc, argv, cfg);
+    if (intended - now > std::chrono::microseconds(200)) {
+        std::this_thread::sleep_until(intended - std::chrono::microseconds(100));
+    }
 
-    std::cout << std::endl << ".____________." << std::endl;
-    std::cout << "|            |" << std::endl;
-    std::cout << "| Parameters |" << std::endl;
-    std::cout << "|____________|" << std::endl << std::endl;
-    std::cout << "[implementation]: " << cfg.implementation << std::endl;
-    std::cout << "[range]:          " << cfg.range << std::endl;
-    std::cout << "[size]:           " << cfg.size << std::endl;
-    std::cout << "[population]:     " << cfg.population << std::endl;
-    std::cout << "[operations]:     " << cfg.operations << std::endl;
-    std::cout << "[threads]:        " << cfg.threads << std::endl;
-    std::cout << "[seed]:           " << cfg.seed << std::endl << std::endl;
+    while (std::chrono::steady_clock::now() < intended);
+
+    if (perf.active()) {
+        perf.resume();
+    }
+}
 
-    set<int>* int_set = NULL;
+// Open-loop worker: operations are issued on a fixed schedule regardless of how long earlier ones took, and latency is
+// measured from the intended start so time spent queued behind a slow operation (e.g. a resize) is not hidden.
+// Workloads that carry their own arrival times are dealt round-robin and replayed on their recorded schedule.
+void do_work_open(set<value_t>* int_set, results &res, config cfg, int thread_id, const workload &w, std::chrono::steady_clock::time_point start) {
 
-    generator = std::default_random_engine(cfg.seed);
-    value_distribution = std::uniform_int_distribution<int>(0, cfg.range);
-    operation_distribution = std::uniform_int_distribution<int>(0, 99);
+    if (w.times && cfg.rate <= 0) {
+        latency_histogram latency;
+        counters local;
+        perf_counters perf(cfg.perf);
+
+        for (long i = thread_id; i < w.count; i += cfg.threads) {
+            if (cfg.duration > 0 && stop_workers.load(std::memory_order_relaxed)) {
+                break;
+            }
+
+            auto intended = start + std::chrono::nanoseconds(w.times[i] - w.times[0]);
+
+            wait_until(intended, perf);
+
+            execute(int_set, w.ops[i], w.keys[i], local);
+
+            auto done = std::chrono::steady_clock::now();
+            latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(done - intended).count());
+        }
+
+        publish_perf(res, perf);
+        publish(res, local);
+
+        std::lock_guard<std::mutex> lock(res.merge_lock);
+        res.latency.merge(latency);
+        return;
+    }
+
+    // Each thread carries an equal share of the aggregate rate
+    double thread_rate = cfg.rate / cfg.threads;
+
+    long begin = slice_begin(cfg, thread_id);
+    long end = slice_end(cfg, thread_id);
+
+    std::default_random_engine arrivals(cfg.seed + thread_id);
+    std::exponential_distribution<double> gap(thread_rate);
+
+    latency_histogram latency;
+    counters local;
+    perf_counters perf(cfg.perf);
+
+    double offset = 0;
+
+    // Time-bounded runs keep cycling through the slice until called off
+    for (long i = begin; begin < end; i++) {
+        if (i == end) {
+            if (cfg.duration <= 0) {
+                break;
+            }
+            i = begin;
+        }
+
+        if (cfg.duration > 0 && stop_workers.load(std::memory_order_relaxed)) {
+            break;
+        }
+
+        if (cfg.arrival == poisson_arrivals) {
+            offset += gap(arrivals);
+        } else {
+            offset += 1.0 / thread_rate;
+        }
+
+        auto intended = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(offset));
+
+        wait_until(intended, perf);
+
+        execute(int_set, w.ops[i], w.keys[i], local);
+
+        auto done = std::chrono::steady_clock::now();
+        latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(done - intended).count());
+    }
+
+    publish_perf(res, perf);
+    publish(res, local);
+
+    std::lock_guard<std::mutex> lock(res.merge_lock);
+    res.latency.merge(latency);
+}
+
+// Create the configured segment, or attach to it if another process got there first
+template <int D> set<value_t>* make_shared_set(config &cfg) {
+    shared_set<value_t, D>* shared_ints = new shared_set<value_t, D>();
+    std::string error;
+
+    std::string name = cfg.segment.empty() ? "/hashset." + std::to_string(getpid()) : cfg.segment;
+
+    if (!shared_ints->create(name, cfg.size, cfg.locks, cfg.limit, cfg.probe_size, cfg.probe_threshold, error)) {
+        if (cfg.segment.empty() || !shared_ints->attach(name, error)) {
+            std::cout << error << std::endl;
+            exit(1);
+        }
+    }
+
+    // A private segment only needs to outlive its mapping
+    if (cfg.segment.empty()) {
+        shared_set<value_t, D>::unlink(name);
+    }
+
+    return shared_ints;
+}
 
+template <int D> set<value_t>* make_set(config &cfg) {
     switch(cfg.implementation){
         case sequential:
-            int_set = new sequential_set<int>(cfg.size, limit);
-            cfg.threads = 1;
-            break;
+            return new sequential_set<value_t, D>(cfg.size, cfg.limit);
         case concurrent:
-            int_set = new concurrent_set<int>(cfg.size, cfg.locks, limit);
-            break;
+            return new concurrent_set<value_t, D>(cfg.size, cfg.locks, cfg.limit, cfg.probe_size, cfg.probe_threshold, cfg.read_mostly);
         case transactional:
-            int_set = new transactional_set<int>(cfg.size, limit);
-            break;
+            return new transactional_set<value_t, D>(cfg.size, cfg.limit, cfg.probe_size, cfg.probe_threshold);
+        case shared:
+            return make_shared_set<D>(cfg);
         default:
-            break;
+            return NULL;
     }
+}
 
-    std::vector<std::thread> threads;
-    results res;
+set<value_t>* make_table(config &cfg) {
+    // The open-addressing sets get as many slots as the cuckoo tables have between them
+    if (cfg.implementation == robinhood) {
+        return new robinhood_set<value_t>(cfg.tables * cfg.size);
+    }
+    else if (cfg.implementation == hopscotch) {
+        return new hopscotch_set<value_t>(cfg.tables * cfg.size, cfg.locks);
+    }
+
+    switch(cfg.tables){
+        case 2:
+            return make_set<2>(cfg);
+        case 3:
+            return make_set<3>(cfg);
+        case 4:
+            return make_set<4>(cfg);
+        default:
+            return NULL;
+    }
+}
 
-    int_set->populate(cfg.population, &random_int);
+set<value_t>* make_set(config &cfg) {
+    set<value_t>* int_set = make_table(cfg);
 
-    std::cout << "[list populated]" << std::endl;
-    
-    std::vector<std::vector<char>> op_dists = op_distributions(cfg);
-    std::vector<std::vector<int>> val_dists = val_distributions(cfg);
+    if (int_set) {
+        int_set->set_growth(cfg.growth);
+    }
 
-    auto start = std::chrono::high_resolution_clock::now();
+    return int_set;
+}
 
-	if (cfg.threads == 1) {
-		do_work(int_set, res, cfg, op_dists[0], val_dists[0]);
-	} else {
-		for (int i = 0; i < cfg.threads; ++i) {
-			threads.push_back(std::thread(&do_work, int_set, std::ref(res), cfg, std::ref(op_dists[i]), std::ref(val_dists[i])));
-		}
+// Build and populate a set with the memory policy requested for it. The calling thread is moved onto <cpu> while it
+// touches the table so first-touch allocation lands on that cpu's node.
+set<value_t>* build_set(config &cfg, topology &machine, int cpu, int node) {
+    cpu_set_t original = topology::affinity();
 
-		for (int i = 0; i < cfg.threads; ++i) {
-			threads.at(i).join();
-		}
-	}
+    if (cpu >= 0) {
+        topology::pin(pthread_self(), cpu);
+    }
 
-    auto end = std::chrono::high_resolution_clock::now();
+    if (cfg.memory == interleaved_memory) {
+        machine.interleave();
+    }
+    else if (cfg.memory == local_memory || cfg.memory == replicated_memory) {
+        machine.prefer(node);
+    }
 
-    std::chrono::microseconds elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    generator = std::default_random_engine(cfg.seed);
+    value_distribution = std::uniform_int_distribution<value_t>(0, cfg.range);
 
-    auto time = elapsed.count();
+    set<value_t>* int_set = make_set(cfg);
 
-    int set_size = int_set->size();
+    if (cfg.reserve) {
+        int_set->reserve(cfg.population);
+    }
 
-    // Print the results
-    std::cout << "._________." << std::endl;
-    std::cout << "|         |" << std::endl;
-    std::cout << "| Results |" << std::endl;
-    std::cout << "|_________|" << std::endl << std::endl;
+    int_set->populate(cfg.population, &random_value);
 
-    std::cout << "[add_true]:           " << res.add_true << std::endl;
-    std::cout << "[add_false]:          " << res.add_false << std::endl << std::endl;
+    // Nothing runs against the set until the workers start, so this is the quiet moment to grow ahead of them
+    int_set->grow();
 
-    std::cout << "[remove_true]:        " << res.remove_true << std::endl;
-    std::cout << "[remove_false]:       " << res.remove_false << std::endl << std::endl;
+    machine.reset();
+    topology::restore(original);
 
-    std::cout << "[contains_true]:      " << res.contains_true << std::endl;
-    std::cout << "[contains_false]:     " << res.contains_false << std::endl << std::endl;
+    return int_set;
+}
 
-    std::cout << "[total_operations]:   " << res.add_true + res.add_false + res.remove_true + res.remove_false + res.contains_true + res.contains_false << std::endl << std::endl;
+// Build, populate and exercise a fresh set. Returns the execution time of the measured region in microseconds.
+long run_benchmark(config &cfg, results &res) {
+    topology machine;
 
-    std::cout << "[expected_size]:      " << cfg.population + res.add_true - res.remove_true << std::endl;
-    std::cout << "[actual_size]:        " << set_size << std::endl << std::endl;
+    if (single_threaded(cfg.implementation)) {
+        cfg.threads = 1;
+    }
 
-    std::cout << "[execution_time]:     " << time << std::endl;
+    std::vector<int> placement = machine.placement(cfg.affinity, cfg.threads, cfg.cpu_list);
+
+    // One set per node when replicating, every worker reads the copy local to its cpu
+    std::vector<set<value_t>*> replicas(cfg.memory == replicated_memory ? machine.nodes() : 1, NULL);
+
+    if (cfg.memory == replicated_memory) {
+        // Only nodes that run a worker get a copy
+        for (int cpu : placement) {
+            int node = machine.node_of(cpu);
+
+            if (replicas[node] == NULL) {
+                replicas[node] = build_set(cfg, machine, cpu, node);
+            }
+        }
+    }
+    else {
+        int cpu = placement.empty() || cfg.memory != local_memory ? -1 : placement[0];
+
+        replicas[0] = build_set(cfg, machine, cpu, cpu >= 0 ? machine.node_of(cpu) : 0);
+    }
+
+    // Replayed workloads are mapped straight from the trace, synthetic ones generated after population
+    trace replay;
+    workload w;
+
+    std::vector<char> op_dist;
+    std::vector<int64_t> val_dist;
+
+    if (!cfg.replay.empty()) {
+        std::string error;
+        if (!replay.open(cfg.replay, w, error)) {
+            std::cout << error << std::endl;
+            exit(1);
+        }
+        cfg.operations = w.count;
+    }
+    else {
+        operation_distribution = std::uniform_int_distribution<int>(0, 99);
+
+        op_dist = op_distributions(cfg);
+        val_dist = val_distributions(cfg);
+
+        w.ops = op_dist.data();
+        w.keys = val_dist.data();
+        w.count = cfg.operations;
+    }
+
+    bool open_loop = cfg.rate > 0 || w.times;
+
+    // Only a shared set rejects adds. Its counter lives in the segment, so this counts every attached process's.
+    uint64_t rejected = cfg.implementation == shared ? replicas[0]->stats().rejected : 0;
+
+    std::vector<set<value_t>*> worker_sets;
+    for (int i = 0; i < cfg.threads; ++i) {
+        int node = placement.empty() ? 0 : machine.node_of(placement[i]);
+        worker_sets.push_back(cfg.memory == replicated_memory ? replicas[node] : replicas[0]);
+    }
+
+    std::vector<pthread_t> threads;
+    claimed_operations = 0;
+    stop_workers = false;
+
+    cpu_set_t original = topology::affinity();
+
+    // Scans run concurrently with the writers for as long as they do
+    std::atomic<bool> scanning(cfg.scan > 0);
+    std::thread scanner;
+
+    if (cfg.scan > 0) {
+        scanner = std::thread([&]() {
+            while (scanning) {
+                auto scan_start = std::chrono::steady_clock::now();
+                worker_sets[0]->snapshot(cfg.scan);
+
+                res.scan_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - scan_start).count();
+                res.scans++;
+            }
+        });
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+	if (cfg.threads == 1 && !open_loop && cfg.duration <= 0) {
+        if (!placement.empty()) {
+            topology::pin(pthread_self(), placement[0]);
+        }
+
+		do_work(worker_sets[0], res, cfg, 0, w);
+	} else {
+        auto schedule_start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < cfg.threads; ++i) {
+            // Workers start on their cpu rather than being moved there after they have begun touching the set
+            int cpu = placement.empty() ? -1 : placement[i];
+            bool started;
+
+            threads.push_back(pthread_t());
+            if (open_loop) {
+                started = topology::start(threads.back(), cpu, [&, i]() {
+                    do_work_open(worker_sets[i], res, cfg, i, w, schedule_start);
+                });
+            } else {
+                started = topology::start(threads.back(), cpu, [&, i]() {
+                    do_work(worker_sets[i], res, cfg, i, w);
+                });
+            }
+
+            if (!started) {
+                std::cout << "Could not start worker " << i << (cpu >= 0 ? " on cpu " + std::to_string(cpu) : "") << std::endl;
+                exit(1);
+            }
+		}
+
+        if (cfg.duration > 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(cfg.duration));
+            stop_workers = true;
+        }
+
+		for (int i = 0; i < cfg.threads; ++i) {
+			pthread_join(threads.at(i), NULL);
+		}
+	}
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    if (cfg.scan > 0) {
+        scanning = false;
+        scanner.join();
+
+        res.snapshot_size = worker_sets[0]->snapshot(cfg.scan).size();
+    }
+
+    topology::restore(original);
+
+    std::chrono::microseconds elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+    res.set_size = worker_sets[0]->size();
+    res.stats = worker_sets[0]->stats();
+    res.memory = worker_sets[0]->memory_usage();
+
+    if (cfg.implementation == shared) {
+        res.add_rejected = std::min((long) (res.stats.rejected - rejected), (long) res.add_false);
+        res.add_false -= res.add_rejected;
+    }
+
+    for (set<value_t>* replica : replicas) {
+        delete replica;
+    }
+
+    return elapsed.count();
+}
+
+// Step the target rate through fractions of the peak closed-loop throughput. The saturation point is the highest rate
+// the implementation still sustains: achieved throughput within 5% of the target and, when given, p99 within the SLO.
+void sweep_rates(config cfg) {
+    double peak = cfg.rate;
+
+    if (peak <= 0) {
+        config calibration = cfg;
+        calibration.rate = 0;
+
+        results res;
+        long time = run_benchmark(calibration, res);
+        peak = (double) completed(res) * 1000000 / time;
+    }
+
+    std::cout << "._______." << std::endl;
+    std::cout << "|       |" << std::endl;
+    std::cout << "| Sweep |" << std::endl;
+    std::cout << "|_______|" << std::endl << std::endl;
+
+    std::cout << "[peak_rate]:          " << (long) peak << std::endl << std::endl;
+
+    std::cout << std::setw(12) << "target" << std::setw(12) << "achieved"
+              << std::setw(10) << "p50_us" << std::setw(10) << "p99_us" << std::setw(10) << "p999_us" << std::setw(10) << "max_us"
+              << std::setw(13) << "sustainable" << std::endl;
+
+    static const double fractions[] = {0.1, 0.25, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0, 1.1, 1.25};
+
+    double saturation = 0;
+
+    for (double fraction : fractions) {
+        cfg.rate = peak * fraction;
+
+        results res;
+        long time = run_benchmark(cfg, res);
+
+        double achieved = (double) completed(res) * 1000000 / time;
+        double p99 = res.latency.percentile(99) / 1000.0;
+
+        bool sustainable = achieved >= 0.95 * cfg.rate && (cfg.slo == 0 || p99 <= cfg.slo);
+        if (sustainable && cfg.rate > saturation) {
+            saturation = cfg.rate;
+        }
+
+        std::cout << std::setw(12) << (long) cfg.rate << std::setw(12) << (long) achieved
+                  << std::setw(10) << res.latency.percentile(50) / 1000 << std::setw(10) << (long) p99
+                  << std::setw(10) << res.latency.percentile(99.9) / 1000 << std::setw(10) << res.latency.max() / 1000
+                  << std::setw(13) << (sustainable ? "yes" : "no") << std::endl;
+    }
+
+    std::cout << std::endl << "[saturation_rate]:    " << (long) saturation << std::endl;
+}
+
+// Hardware counters per operation, plus instructions per cycle when both are available
+void print_perf(perf_totals &perf, long operations) {
+    std::cout << std::endl << "._____________." << std::endl;
+    std::cout << "|             |" << std::endl;
+    std::cout << "|  Counters   |" << std::endl;
+    std::cout << "|_____________|" << std::endl << std::endl;
+
+    for (int e = 0; e < perf_events; e++) {
+        std::string label = std::string("[") + perf_event_names[e] + "/op]:";
+        std::cout << std::left << std::setw(22) << label << std::right;
+
+        if (perf.available[e] && operations > 0) {
+            std::cout << (double) perf.values[e] / operations << std::endl;
+        } else {
+            std::cout << "n/a" << std::endl;
+        }
+    }
+
+    bool any = false;
+    for (int e = 0; e < perf_events; e++) {
+        any = any || perf.available[e];
+    }
+
+    if (!any) {
+        std::cout << "[note]:               no counters could be opened, check kernel.perf_event_paranoid or PMU access" << std::endl;
+    }
+
+    if (perf.available[cycles_event] && perf.available[instructions_event] && perf.values[cycles_event] > 0) {
+        std::cout << "[ipc]:                " << (double) perf.values[instructions_event] / perf.values[cycles_event] << std::endl;
+    }
+}
+
+void print_stats(set_stats &s, int tables) {
+    std::cout << std::endl << "._____________." << std::endl;
+    std::cout << "|             |" << std::endl;
+    std::cout << "|  Internals  |" << std::endl;
+    std::cout << "|_____________|" << std::endl << std::endl;
+
+    std::cout << "[capacity]:           " << s.capacity << std::endl;
+    std::cout << "[load_factor]:        " << s.load_factor << std::endl;
+
+    std::cout << "[occupancy]:          ";
+    for (size_t k = 0; k < s.occupancy.size(); k++) {
+        std::cout << (k ? " " : "") << k << ":" << s.occupancy[k];
+    }
+    std::cout << std::endl;
+
+    if (s.rejected) {
+        std::cout << "[rejected]:           " << s.rejected << std::endl;
+    }
+
+    if (!s.counters_enabled) {
+        std::cout << "[counters]:           disabled, build with STATS=1" << std::endl;
+        return;
+    }
+
+    std::cout << std::endl << "[resizes]:            " << s.resizes << std::endl;
+    std::cout << "[resize_time]:        " << s.resize_ns / 1000 << std::endl;
+
+    // Path lengths are bucketed by powers of two, print the upper bound of each non-empty bucket
+    uint64_t insertions = 0;
+    std::cout << "[path_lengths]:       ";
+    for (size_t b = 0; b < s.path_lengths.size(); b++) {
+        insertions += s.path_lengths[b];
+        if (s.path_lengths[b]) {
+            std::cout << "<" << (1L << b) << ":" << s.path_lengths[b] << " ";
+        }
+    }
+    std::cout << std::endl;
+    std::cout << "[mean_path_length]:   " << (insertions ? (double) s.displacements / insertions : 0) << std::endl;
+
+    if (s.lock_acquisitions) {
+        std::cout << std::endl << "[lock_acquisitions]:  " << s.lock_acquisitions << std::endl;
+        std::cout << "[lock_contended]:     " << s.lock_contended << std::endl;
+        std::cout << "[lock_wait_time]:     " << s.lock_wait_ns / 1000 << std::endl;
+
+        // The handful of stripes that saw the most contention, as table/stripe
+        std::vector<size_t> order(s.stripe_contended.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+
+        size_t top = std::min(order.size(), (size_t) 5);
+        std::partial_sort(order.begin(), order.begin() + top, order.end(), [&](size_t a, size_t b) {
+            return s.stripe_contended[a] > s.stripe_contended[b];
+        });
+
+        std::cout << "[hottest_stripes]:    ";
+        for (size_t i = 0; i < top && s.stripe_contended[order[i]]; i++) {
+            size_t per_table = s.stripe_contended.size() / tables;
+            std::cout << order[i] / per_table << "/" << order[i] % per_table << ":" << s.stripe_contended[order[i]] << " ";
+        }
+        std::cout << std::endl;
+    }
+
+    if (s.tx_attempts) {
+        std::cout << std::endl << "[tx_attempts]:        " << s.tx_attempts << std::endl;
+        std::cout << "[tx_commits]:         " << s.tx_commits << std::endl;
+        std::cout << "[tx_aborts]:          " << s.tx_attempts - s.tx_commits << std::endl;
+    }
+}
+
+// Run warm-ups and trials for every combination of implementation, thread count and load factor, and write one row of
+// statistics per combination. Load factor is keys per slot across both tables of --size slots.
+int run_harness(config cfg) {
+    std::vector<implementation_t> implementations = cfg.sweep_implementations;
+    if (implementations.empty()) {
+        implementations.push_back(cfg.implementation);
+    }
+
+    std::vector<int> thread_counts = cfg.sweep_threads;
+    if (thread_counts.empty()) {
+        thread_counts.push_back(cfg.threads);
+    }
+
+    std::vector<double> loads = cfg.sweep_load;
+    if (loads.empty()) {
+        loads.push_back((double) cfg.population / ((double) cfg.tables * cfg.size));
+    }
+
+    std::vector<result_row> rows;
+
+    for (implementation_t implementation : implementations) {
+        for (int threads : thread_counts) {
+            // The single threaded sets only need measuring once
+            if (single_threaded(implementation) && threads != thread_counts[0]) {
+                continue;
+            }
+
+            for (double load : loads) {
+                config point = cfg;
+                point.implementation = implementation;
+                point.threads = single_threaded(implementation) ? 1 : threads;
+                point.population = load * cfg.tables * cfg.size;
+
+                std::cerr << "[running]: " << implementation_names[implementation] << ", " << point.threads
+                          << " threads, load " << load << std::endl;
+
+                for (int w = 0; w < cfg.warmup; w++) {
+                    results res;
+                    run_benchmark(point, res);
+                }
+
+                std::vector<double> throughput;
+                std::vector<double> times;
+                std::vector<double> p99;
+
+                for (int trial = 0; trial < cfg.trials; trial++) {
+                    point.seed = cfg.seed + trial;
+
+                    results res;
+                    long time = run_benchmark(point, res);
+
+                    throughput.push_back((double) completed(res) * 1000000 / time);
+                    times.push_back(time);
+                    p99.push_back(res.latency.percentile(99) / 1000.0);
+                }
+
+                sample_stats stats(throughput);
+
+                result_row row;
+                row.implementation = implementation_names[implementation];
+                row.threads = point.threads;
+                row.load_factor = load;
+                row.population = point.population;
+                row.operations = point.operations;
+                row.trials = stats.n;
+                row.throughput_mean = stats.mean;
+                row.throughput_stddev = stats.stddev;
+                row.throughput_ci95 = stats.ci95;
+                row.time_mean = sample_stats(times).mean;
+                row.p99_mean = sample_stats(p99).mean;
+
+                rows.push_back(row);
+            }
+        }
+    }
+
+    std::ofstream file;
+    if (!cfg.output.empty()) {
+        file.open(cfg.output);
+        if (!file) {
+            std::cout << "Could not open '" << cfg.output << "' for writing" << std::endl;
+            return 1;
+        }
+    }
+
+    std::ostream& out = cfg.output.empty() ? std::cout : file;
+
+    switch (cfg.format) {
+        case csv_format: report::write_csv(rows, out); break;
+        case json_format: report::write_json(rows, out); break;
+        default: report::write_text(rows, out); break;
+    }
+
+    return 0;
+}
+
+// Generate the synthetic workload the configuration describes and save it as a trace instead of running it. Arrival
+// times are included when a target rate is given.
+int record_workload(config cfg) {
+    generator = std::default_random_engine(cfg.seed);
+    value_distribution = std::uniform_int_distribution<value_t>(0, cfg.range);
+    operation_distribution = std::uniform_int_distribution<int>(0, 99);
+
+    std::vector<char> op_dist = op_distributions(cfg);
+    std::vector<int64_t> val_dist = val_distributions(cfg);
+    std::vector<uint64_t> times;
+
+    workload w;
+    w.ops = op_dist.data();
+    w.keys = val_dist.data();
+    w.count = cfg.operations;
+
+    if (cfg.rate > 0) {
+        times = arrival_distributions(cfg);
+        w.times = times.data();
+    }
+
+    if (!trace::write(cfg.record, w)) {
+        std::cout << "Could not write trace to '" << cfg.record << "'" << std::endl;
+        return 1;
+    }
+
+    std::cout << "[recorded]:           " << w.count << " operations to " << cfg.record << (w.times ? " with arrival times" : "") << std::endl;
+
+    return 0;
+}
+
+// Sweep the cuckoo parameters over the configured workload and report each combination's mean throughput against its
+// memory per key at the end of the run. A combination is on the Pareto front when every other one is either slower
+// or uses more memory per key.
+int run_tuner(config cfg) {
+    std::vector<int> limits = cfg.tune_limit;
+    if (limits.empty()) {
+        limits.push_back(cfg.limit);
+    }
+
+    // Only the bucketed sets have a probe size and threshold, the others just try the limits
+    std::vector<int> probe_sizes = cfg.tune_probe_size;
+    if (!bucketed(cfg.implementation)) {
+        probe_sizes = {cfg.probe_size};
+    }
+    else if (probe_sizes.empty()) {
+        probe_sizes = {2, 4, 8};
+    }
+
+    struct point {
+        int limit;
+        int probe_size;
+        int probe_threshold;
+        sample_stats throughput;
+        double bytes_per_key;
+        bool pareto;
+    };
+
+    std::vector<point> points;
+
+    for (int limit : limits) {
+        for (int probe_size : probe_sizes) {
+            // Without an explicit list try a lone slot, half the bucket, and all but one slot below the threshold
+            std::vector<int> thresholds = cfg.tune_probe_threshold;
+            if (!bucketed(cfg.implementation)) {
+                thresholds = {cfg.probe_threshold};
+            }
+            else if (thresholds.empty()) {
+                thresholds = {1, probe_size / 2, probe_size - 1};
+            }
+
+            std::sort(thresholds.begin(), thresholds.end());
+            thresholds.erase(std::unique(thresholds.begin(), thresholds.end()), thresholds.end());
+
+            for (int probe_threshold : thresholds) {
+                if (bucketed(cfg.implementation) && (probe_threshold < 1 || probe_threshold >= probe_size)) {
+                    continue;
+                }
+
+                config trial_cfg = cfg;
+                trial_cfg.limit = limit;
+                trial_cfg.probe_size = probe_size;
+                trial_cfg.probe_threshold = probe_threshold;
+
+                std::cerr << "[running]: limit " << limit << ", probe size " << probe_size << ", threshold " << probe_threshold << std::endl;
+
+                for (int w = 0; w < cfg.warmup; w++) {
+                    results res;
+                    run_benchmark(trial_cfg, res);
+                }
+
+                std::vector<double> throughput;
+                double bytes_per_key = 0;
+
+                for (int trial = 0; trial < cfg.trials; trial++) {
+                    trial_cfg.seed = cfg.seed + trial;
+
+                    results res;
+                    long time = run_benchmark(trial_cfg, res);
+
+                    throughput.push_back((double) completed(res) * 1000000 / time);
+                    bytes_per_key = res.set_size ? (double) res.memory / res.set_size : 0;
+                }
+
+                points.push_back({limit, probe_size, probe_threshold, sample_stats(throughput), bytes_per_key, false});
+            }
+        }
+    }
+
+    // Walk from the leanest combination up, a point is on the front if it beats everything leaner than it
+    std::sort(points.begin(), points.end(), [](const point& a, const point& b) {
+        if (a.bytes_per_key != b.bytes_per_key) return a.bytes_per_key < b.bytes_per_key;
+        return a.throughput.mean > b.throughput.mean;
+    });
+
+    double fastest = -1;
+    for (point& p : points) {
+        if (p.throughput.mean > fastest) {
+            p.pareto = true;
+            fastest = p.throughput.mean;
+        }
+    }
+
+    std::cout << "._______." << std::endl;
+    std::cout << "|       |" << std::endl;
+    std::cout << "| Tuner |" << std::endl;
+    std::cout << "|_______|" << std::endl << std::endl;
+
+    std::cout << std::setw(8) << "limit" << std::setw(8) << "probe" << std::setw(11) << "threshold"
+              << std::setw(14) << "ops/sec" << std::setw(12) << "ci95" << std::setw(12) << "bytes/key"
+              << std::setw(8) << "pareto" << std::endl;
+
+    for (point& p : points) {
+        std::cout << std::setw(8) << p.limit << std::setw(8) << p.probe_size << std::setw(11) << p.probe_threshold
+                  << std::setw(14) << (long) p.throughput.mean << std::setw(12) << (long) p.throughput.ci95
+                  << std::setw(12) << std::fixed << std::setprecision(1) << p.bytes_per_key
+                  << std::defaultfloat << std::setprecision(6) << std::setw(8) << (p.pareto ? "*" : "") << std::endl;
+    }
+
+    return 0;
+}
+
+// Build two sets from different seeds and time the bulk set operations between them, with the per-key contains()
+// loop they replace as the baseline
+int run_algebra(config cfg) {
+    topology machine;
+
+    set<value_t>* a = build_set(cfg, machine, -1, 0);
+    cfg.seed++;
+    set<value_t>* b = build_set(cfg, machine, -1, 0);
+
+    std::cout << std::endl << ".______________." << std::endl;
+    std::cout << "|              |" << std::endl;
+    std::cout << "| Set algebra  |" << std::endl;
+    std::cout << "|______________|" << std::endl << std::endl;
+    std::cout << "[implementation]: " << implementation_names[cfg.implementation] << std::endl;
+    std::cout << "[sizes]:          " << a->size() << " and " << b->size() << std::endl;
+    std::cout << "[threads]:        " << cfg.threads << std::endl << std::endl;
+
+    auto timed = [](const std::function<long()>& op, long& result) {
+        auto start = std::chrono::steady_clock::now();
+        result = op();
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    std::cout << std::setw(14) << "operation" << std::setw(12) << "result" << std::setw(14) << "time (us)" << std::endl;
+
+    auto row = [](const char* name, long result, long time) {
+        std::cout << std::setw(14) << name << std::setw(12) << result << std::setw(14) << time << std::endl;
+    };
+
+    long result;
+    long time;
+
+    time = timed([&]() {
+        long count = 0;
+        for (value_t value : a->snapshot()) {
+            count += b->contains(value);
+        }
+        return count;
+    }, result);
+    row("per-key", result, time);
+
+    time = timed([&]() { return (long) algebra::intersect(*a, *b, cfg.threads).size(); }, result);
+    row("intersect", result, time);
+
+    time = timed([&]() { return (long) algebra::subtract(*a, *b, cfg.threads).size(); }, result);
+    row("subtract", result, time);
+
+    // The single threaded sets can't take concurrent adds
+    int writers = single_threaded(cfg.implementation) ? 1 : cfg.threads;
+
+    time = timed([&]() { return (long) algebra::unite_into(*a, *b, writers); }, result);
+    row("unite_into", result, time);
+
+    delete a;
+    delete b;
+
+    return 0;
+}
+
+// Insert <operations> random keys into an empty set, split between the workers, once a key at a time and once through
+// insert_batch(), and compare the two
+int run_ingest(config cfg) {
+    generator = std::default_random_engine(cfg.seed);
+    value_distribution = std::uniform_int_distribution<value_t>(0, cfg.range);
+
+    std::vector<value_t> keys(cfg.operations);
+    for (value_t& key : keys) {
+        key = random_value();
+    }
+
+    int workers = single_threaded(cfg.implementation) ? 1 : cfg.threads;
+
+    std::cout << std::endl << ".________." << std::endl;
+    std::cout << "|        |" << std::endl;
+    std::cout << "| Ingest |" << std::endl;
+    std::cout << "|________|" << std::endl << std::endl;
+    std::cout << "[implementation]: " << implementation_names[cfg.implementation] << std::endl;
+    std::cout << "[keys]:           " << keys.size() << std::endl;
+    std::cout << "[threads]:        " << workers << std::endl << std::endl;
+
+    std::cout << std::setw(14) << "mode" << std::setw(12) << "added" << std::setw(14) << "time (us)"
+              << std::setw(14) << "keys/sec" << std::setw(14) << "bytes/key" << std::setw(14) << "load" << std::endl;
+
+    for (int batched = 0; batched < 2; batched++) {
+        set<value_t>* int_set = make_set(cfg);
+        std::atomic<long> added(0);
+
+        if (cfg.reserve) {
+            int_set->reserve(keys.size());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < workers; t++) {
+            threads.push_back(std::thread([&, t]() {
+                long begin = (long) keys.size() * t / workers;
+                long end = (long) keys.size() * (t + 1) / workers;
+
+                if (batched) {
+                    added += int_set->insert_batch(&keys[begin], end - begin);
+                    return;
+                }
+
+                long local = 0;
+                for (long i = begin; i < end; i++) {
+                    local += int_set->add(keys[i]);
+                }
+                added += local;
+            }));
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        long time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << std::setw(14) << (batched ? "insert_batch" : "per-key") << std::setw(12) << added
+                  << std::setw(14) << time << std::setw(14) << (long) (keys.size() * 1000000.0 / time)
+                  << std::setw(14) << (added ? (double) int_set->memory_usage() / added : 0)
+                  << std::setw(14) << int_set->stats().load_factor << std::endl;
+
+        delete int_set;
+    }
+
+    return 0;
+}
+
+// Run a workload of group operations, mix_add + mix_remove percent of them rotating between add_all() of --group
+// random keys, remove_all() of as many, and replace() of one random key by another, the rest single contains. It runs
+// once through the set's own atomic group operations, and once with every operation made of single adds, removes and
+// lookups under one external lock, the way a caller would get the same atomicity without them.
+int run_multi(config cfg) {
+    generator = std::default_random_engine(cfg.seed);
+    value_distribution = std::uniform_int_distribution<value_t>(0, cfg.range);
+    operation_distribution = std::uniform_int_distribution<int>(0, 99);
+
+    int workers = single_threaded(cfg.implementation) ? 1 : cfg.threads;
+
+    // Every worker draws its keys and operations up front, the generator isn't thread safe
+    std::vector<std::vector<value_t>> keys(workers);
+    std::vector<std::vector<char>> ops(workers);
+
+    for (int t = 0; t < workers; t++) {
+        long count = cfg.operations * (t + 1) / workers - cfg.operations * t / workers;
+
+        for (long i = 0; i < count; i++) {
+            char op = operation_distribution(generator) < cfg.mix_add + cfg.mix_remove ? "arp"[i % 3] : 'c';
+            ops[t].push_back(op);
+
+            int n = op == 'c' ? 1 : op == 'p' ? 2 : cfg.group;
+            for (int k = 0; k < n; k++) {
+                keys[t].push_back(random_value());
+            }
+        }
+    }
+
+    std::cout << std::endl << ".___________." << std::endl;
+    std::cout << "|           |" << std::endl;
+    std::cout << "| Multi-key |" << std::endl;
+    std::cout << "|___________|" << std::endl << std::endl;
+    std::cout << "[implementation]: " << implementation_names[cfg.implementation] << std::endl;
+    std::cout << "[operations]:     " << cfg.operations << std::endl;
+    std::cout << "[group]:          " << cfg.group << std::endl;
+    std::cout << "[threads]:        " << workers << std::endl << std::endl;
+
+    std::cout << std::setw(14) << "mode" << std::setw(12) << "size" << std::setw(14) << "time (us)"
+              << std::setw(14) << "ops/sec" << std::endl;
+
+    for (int locked = 0; locked < 2; locked++) {
+        // Both modes start from the same population
+        generator = std::default_random_engine(cfg.seed + 1);
+
+        set<value_t>* int_set = make_set(cfg);
+        int_set->populate(cfg.population, &random_value);
+
+        std::mutex external;
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < workers; t++) {
+            threads.push_back(std::thread([&, t]() {
+                const value_t* key = keys[t].data();
+
+                for (char op : ops[t]) {
+                    std::unique_lock<std::mutex> held(external, std::defer_lock);
+                    if (locked) {
+                        held.lock();
+                    }
+
+                    switch (op) {
+                        case 'a':
+                            if (locked) {
+                                for (int k = 0; k < cfg.group; k++) {
+                                    int_set->add(key[k]);
+                                }
+                            }
+                            else {
+                                int_set->add_all(key, cfg.group);
+                            }
+                            key += cfg.group;
+                            break;
+                        case 'r':
+                            if (locked) {
+                                for (int k = 0; k < cfg.group; k++) {
+                                    int_set->remove(key[k]);
+                                }
+                            }
+                            else {
+                                int_set->remove_all(key, cfg.group);
+                            }
+                            key += cfg.group;
+                            break;
+                        case 'p':
+                            if (locked) {
+                                if (!int_set->contains(key[1]) && int_set->remove(key[0])) {
+                                    int_set->add(key[1]);
+                                }
+                            }
+                            else {
+                                int_set->replace(key[0], key[1]);
+                            }
+                            key += 2;
+                            break;
+                        default:
+                            int_set->contains(*key++);
+                    }
+                }
+            }));
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        long time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << std::setw(14) << (locked ? "external-lock" : "atomic") << std::setw(12) << int_set->size()
+                  << std::setw(14) << time << std::setw(14) << (long) (cfg.operations * 1000000.0 / std::max(time, 1L)) << std::endl;
+
+        delete int_set;
+    }
+
+    return 0;
+}
+
+// Populate a logged set, checkpoint it, run --operations logged adds and removes past the checkpoint, then time
+// recovering a fresh set from the directory against the time the population took to build
+int run_recovery(config cfg) {
+    generator = std::default_random_engine(cfg.seed);
+    value_distribution = std::uniform_int_distribution<value_t>(0, cfg.range);
+
+    int workers = single_threaded(cfg.implementation) ? 1 : cfg.threads;
+    std::string dir = cfg.log.empty() ? "/tmp/hashset.log." + std::to_string(getpid()) : cfg.log;
+    std::string error;
+
+    std::cout << std::endl << ".__________." << std::endl;
+    std::cout << "|          |" << std::endl;
+    std::cout << "| Recovery |" << std::endl;
+    std::cout << "|__________|" << std::endl << std::endl;
+    std::cout << "[implementation]: " << implementation_names[cfg.implementation] << std::endl;
+    std::cout << "[log]:            " << dir << std::endl;
+    std::cout << "[population]:     " << cfg.population << std::endl;
+    std::cout << "[operations]:     " << cfg.operations << std::endl;
+    std::cout << "[threads]:        " << workers << std::endl << std::endl;
+
+    logged_set<value_t>* original = new logged_set<value_t>(make_set(cfg));
+    if (!original->open(dir, workers, error)) {
+        std::cout << error << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    original->populate(cfg.population, &random_value);
+    long populate_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    bool checkpointed = original->checkpoint();
+    long checkpoint_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    // Half adds and half removes of random keys, all of them logged after the checkpoint
+    std::vector<std::thread> threads;
+    for (int t = 0; t < workers; t++) {
+        long begin = cfg.operations * t / workers;
+        long end = cfg.operations * (t + 1) / workers;
+        std::vector<value_t> keys;
+
+        for (long i = begin; i < end; i++) {
+            keys.push_back(random_value());
+        }
+
+        threads.push_back(std::thread([original, keys]() {
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (i % 2) {
+                    original->remove(keys[i]);
+                }
+                else {
+                    original->add(keys[i]);
+                }
+            }
+        }));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    bool synced = original->sync();
+    long expected = original->size();
+    delete original;
+
+    logged_set<value_t>* recovered = new logged_set<value_t>(make_set(cfg));
+
+    start = std::chrono::steady_clock::now();
+    bool opened = recovered->open(dir, workers, error);
+    long recover_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    long actual = recovered->size();
+    delete recovered;
+
+    if (cfg.log.empty()) {
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d)) {
+                unlink((dir + "/" + e->d_name).c_str());
+            }
+            closedir(d);
+        }
+        rmdir(dir.c_str());
+    }
+
+    if (!checkpointed || !synced || !opened) {
+        std::cout << (opened ? "Writing the log failed" : error) << std::endl;
+        return 1;
+    }
+
+    std::cout << "[populate_time]:  " << populate_time << " us" << std::endl;
+    std::cout << "[checkpoint]:     " << checkpoint_time << " us" << std::endl;
+    std::cout << "[recover_time]:   " << recover_time << " us" << std::endl;
+    std::cout << "[expected_size]:  " << expected << std::endl;
+    std::cout << "[actual_size]:    " << actual << std::endl;
+
+    return expected == actual ? 0 : 1;
+}
+
+// driver compare <baseline> <candidate> [--threshold percent]. Exits non-zero when any configuration regressed or is
+// missing from the candidate.
+int run_compare(int argc, char** argv) {
+    config cfg;
+    parseargs(argc, argv, cfg);
+
+    if (argc - optind != 2) {
+        std::cout << "Usage: driver compare <baseline> <candidate> [--threshold percent]" << std::endl;
+        return 2;
+    }
+
+    std::vector<result_row> baseline;
+    std::vector<result_row> candidate;
+
+    for (int i = 0; i < 2; i++) {
+        if (!report::read(argv[optind + i], i ? candidate : baseline)) {
+            std::cout << "Could not read results from " << argv[optind + i] << ", only csv and json reports can be compared" << std::endl;
+            return 2;
+        }
+    }
+
+    int missing;
+    int regressions = report::compare(baseline, candidate, cfg.threshold, std::cout, missing);
+
+    std::cout << std::endl << "[regressions]:        " << regressions << std::endl;
+    std::cout << "[missing]:            " << missing << std::endl;
+
+    return regressions || missing ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+
+    if (argc > 1 && !strcmp(argv[1], "compare")) {
+        return run_compare(argc - 1, argv + 1);
+    }
+
+    bool harness = argc > 1 && !strcmp(argv[1], "harness");
+    bool tuner = argc > 1 && !strcmp(argv[1], "tune");
+    bool bulk = argc > 1 && !strcmp(argv[1], "algebra");
+    bool ingest = argc > 1 && !strcmp(argv[1], "ingest");
+    bool recovery = argc > 1 && !strcmp(argv[1], "recover");
+    bool multi = argc > 1 && !strcmp(argv[1], "multi");
+    if (harness || tuner || bulk || ingest || recovery || multi) {
+        argc--;
+        argv++;
+    }
+
+    config cfg;
+    parseargs(argc, argv, cfg);
+
+    if (cfg.limit < 1 || cfg.probe_size < 1 || cfg.probe_threshold < 1 || cfg.probe_threshold >= cfg.probe_size) {
+        std::cout << "Cuckoo parameters need limit >= 1 and 1 <= probe threshold < probe size" << std::endl;
+        exit(1);
+    }
+
+    if (cfg.tables < 2 || cfg.tables > 4) {
+        std::cout << "Supported table counts are 2, 3, or 4" << std::endl;
+        exit(1);
+    }
+
+    if (cfg.growth.max_load <= 0 || cfg.growth.factor <= 1 || cfg.growth.idle_load < 0) {
+        std::cout << "Growth needs a positive maximum load, a factor above 1 and a non-negative idle load" << std::endl;
+        exit(1);
+    }
+
+    if (cfg.read_mostly < 0 || (cfg.read_mostly > 0 && cfg.implementation != concurrent)) {
+        std::cout << "Read-mostly mode needs the concurrent implementation and a positive publish batch" << std::endl;
+        exit(1);
+    }
+
+    if (harness) {
+        return run_harness(cfg);
+    }
+
+    if (tuner) {
+        return run_tuner(cfg);
+    }
+
+    if (bulk) {
+        return run_algebra(cfg);
+    }
+
+    if (ingest) {
+        return run_ingest(cfg);
+    }
+
+    if (recovery) {
+        return run_recovery(cfg);
+    }
+
+    if (multi) {
+        if (cfg.group < 1) {
+            std::cout << "Groups need at least one value" << std::endl;
+            exit(1);
+        }
+
+        return run_multi(cfg);
+    }
+
+    if (!cfg.record.empty()) {
+        return record_workload(cfg);
+    }
+
+    if (!cfg.replay.empty()) {
+        trace replay;
+        workload w;
+        std::string error;
+
+        if (!replay.open(cfg.replay, w, error)) {
+            std::cout << error << std::endl;
+            return 1;
+        }
+
+        cfg.operations = w.count;
+    }
+
+    if (single_threaded(cfg.implementation)) {
+        cfg.threads = 1;
+
+        // A single threaded set can't be read while it is being written
+        if (cfg.scan > 0) {
+            std::cout << "Background scans need a concurrent implementation" << std::endl;
+            exit(1);
+        }
+    }
+
+    if (cfg.memory == replicated_memory) {
+        if (cfg.mix_add || cfg.mix_remove) {
+            std::cout << "Replicated tables are only valid for read-only workloads, use '--mix 0:0'" << std::endl;
+            exit(1);
+        }
+
+        // Replicas are chosen by the node a worker runs on, so workers must be pinned
+        if (cfg.affinity == no_affinity) {
+            cfg.affinity = compact_affinity;
+        }
+    }
+
+    topology machine;
+
+    for (int id : cfg.cpu_list) {
+        if (!machine.online(id)) {
+            std::cout << "Cpu " << id << " in the affinity list is not online" << std::endl;
+            exit(1);
+        }
+    }
+
+    std::vector<int> placement = machine.placement(cfg.affinity, cfg.threads, cfg.cpu_list);
+
+    std::cout << std::endl << ".____________." << std::endl;
+    std::cout << "|            |" << std::endl;
+    std::cout << "| Parameters |" << std::endl;
+    std::cout << "|____________|" << std::endl << std::endl;
+    std::cout << "[implementation]: " << cfg.implementation << std::endl;
+    std::cout << "[range]:          " << cfg.range << std::endl;
+    std::cout << "[size]:           " << cfg.size << std::endl;
+    std::cout << "[population]:     " << cfg.population << std::endl;
+    std::cout << "[operations]:     " << cfg.operations << std::endl;
+    std::cout << "[threads]:        " << cfg.threads << std::endl;
+    std::cout << "[seed]:           " << cfg.seed << std::endl;
+    std::cout << "[limit]:          " << cfg.limit << std::endl;
+    std::cout << "[tables]:         " << cfg.tables << std::endl;
+
+    if (cfg.implementation == shared && !cfg.segment.empty()) {
+        std::cout << "[segment]:        " << cfg.segment << std::endl;
+    }
+
+    if (bucketed(cfg.implementation)) {
+        std::cout << "[probe_size]:     " << cfg.probe_size << std::endl;
+        std::cout << "[threshold]:      " << cfg.probe_threshold << std::endl;
+    }
+    if (!cfg.replay.empty()) {
+        std::cout << "[replay]:         " << cfg.replay << std::endl;
+    }
+
+    if (cfg.duration > 0) {
+        std::cout << "[duration]:       " << cfg.duration << std::endl;
+    }
+
+    if (cfg.chunk > 0) {
+        std::cout << "[chunk]:          " << cfg.chunk << std::endl;
+    }
+
+    if (cfg.read_mostly > 0) {
+        std::cout << "[read_mostly]:    " << cfg.read_mostly << std::endl;
+    }
+
+    if (cfg.growth.max_load < 1 || cfg.growth.factor != 2 || cfg.growth.idle_load > 0 || cfg.reserve) {
+        std::cout << "[max_load]:       " << cfg.growth.max_load << std::endl;
+        std::cout << "[growth]:         " << cfg.growth.factor << std::endl;
+        std::cout << "[idle_load]:      " << cfg.growth.idle_load << std::endl;
+        std::cout << "[reserve]:        " << (cfg.reserve ? "yes" : "no") << std::endl;
+    }
+
+    std::cout << "[mix]:            " << cfg.mix_add << ":" << cfg.mix_remove << ":" << 100 - cfg.mix_add - cfg.mix_remove << std::endl;
+
+    // Enough about the machine and placement to reproduce the run elsewhere
+    static const char* affinity_names[] = {"none", "compact", "scatter", "list"};
+    static const char* memory_names[] = {"first-touch", "interleave", "local", "replicate"};
+
+    std::cout << "[topology]:       " << machine.nodes() << " nodes, " << machine.packages() << " packages, "
+              << machine.cores() << " cores, " << machine.cpu_count() << " cpus" << std::endl;
+    std::cout << "[affinity]:       " << affinity_names[cfg.affinity] << std::endl;
+
+    if (!placement.empty()) {
+        std::cout << "[placement]:      ";
+        for (size_t i = 0; i < placement.size(); i++) {
+            std::cout << (i ? "," : "") << placement[i] << "@" << machine.node_of(placement[i]);
+        }
+        std::cout << std::endl;
+    }
+
+    std::cout << "[numa]:           " << memory_names[cfg.memory] << std::endl;
+
+    if (cfg.rate > 0 || cfg.sweep) {
+        std::cout << "[rate]:           " << (long) cfg.rate << std::endl;
+        std::cout << "[arrival]:        " << (cfg.arrival == poisson_arrivals ? "poisson" : "constant") << std::endl;
+        std::cout << "[slo]:            " << cfg.slo << std::endl;
+    }
+
+    std::cout << std::endl;
+
+    if (cfg.sweep) {
+        sweep_rates(cfg);
+        return 0;
+    }
+
+    results res;
+
+    auto time = run_benchmark(cfg, res);
+
+    // Print the results
+    std::cout << "._________." << std::endl;
+    std::cout << "|         |" << std::endl;
+    std::cout << "| Results |" << std::endl;
+    std::cout << "|_________|" << std::endl << std::endl;
+
+    std::cout << "[add_true]:           " << res.add_true << std::endl;
+    std::cout << "[add_false]:          " << res.add_false << std::endl;
+
+    if (res.add_rejected) {
+        std::cout << "[add_rejected]:       " << res.add_rejected << std::endl;
+    }
+    std::cout << std::endl;
+
+    std::cout << "[remove_true]:        " << res.remove_true << std::endl;
+    std::cout << "[remove_false]:       " << res.remove_false << std::endl << std::endl;
+
+    std::cout << "[contains_true]:      " << res.contains_true << std::endl;
+    std::cout << "[contains_false]:     " << res.contains_false << std::endl << std::endl;
+
+    std::cout << "[total_operations]:   " << completed(res) << std::endl << std::endl;
+
+    // A rejected add never placed its value, so the sizes still agree when adds were dropped; add_rejected says so
+    std::cout << "[expected_size]:      " << cfg.population + res.add_true - res.remove_true << std::endl;
+    std::cout << "[actual_size]:        " << res.set_size << std::endl;
+    std::cout << "[memory]:             " << res.memory << std::endl;
+    std::cout << "[bytes_per_key]:      " << (res.set_size ? (double) res.memory / res.set_size : 0) << std::endl << std::endl;
+
+    std::cout << "[execution_time]:     " << time << std::endl;
+    std::cout << "[throughput]:         " << (long) ((double) completed(res) * 1000000 / time) << std::endl;
+
+    if (cfg.scan > 0) {
+        std::cout << std::endl;
+        std::cout << "[scans]:              " << res.scans << std::endl;
+        std::cout << "[scan_time]:          " << (res.scans ? res.scan_time / res.scans : 0) << std::endl;
+        std::cout << "[snapshot_size]:      " << res.snapshot_size << std::endl;
+    }
+
+    if (res.latency.count() > 0) {
+        std::cout << std::endl;
+
+        // Latencies are measured from each operation's intended start, in microseconds
+        std::cout << "[latency_p50]:        " << res.latency.percentile(50) / 1000 << std::endl;
+        std::cout << "[latency_p99]:        " << res.latency.percentile(99) / 1000 << std::endl;
+        std::cout << "[latency_p999]:       " << res.latency.percentile(99.9) / 1000 << std::endl;
+        std::cout << "[latency_max]:        " << res.latency.max() / 1000 << std::endl;
+    }
+
+    if (res.perf.enabled) {
+        print_perf(res.perf, completed(res));
+    }
+
+    // Hopscotch has a single table of segment locks
+    print_stats(res.stats, cfg.implementation == hopscotch ? 1 : cfg.tables);
 
-    delete int_set;
     return 0;
 }
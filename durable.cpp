@@ -0,0 +1,628 @@
+#ifndef DURABLE_CPP
+#define DURABLE_CPP
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "set.h"
+
+// Files in a log directory:
+//
+//   manifest         which log segment replay starts from, replaced atomically after each checkpoint
+//   checkpoint.<p>   values of partition p as of the checkpoint that last found it changed
+//   log.<n>          add and remove records in the order they were applied, one segment per checkpoint
+//
+// Values are split into partitions by hash. A checkpoint only rewrites the partitions written to since the previous
+// one, each from its last checkpoint file and the log records since, and never reads the set itself. When writes are
+// concentrated in a few partitions its work follows the rate of change; writes spread over random keys touch every
+// partition, and a checkpoint then rewrites the whole set one partition at a time.
+struct durable_manifest {
+    char magic[8];
+    uint32_t version;
+    uint32_t partitions;
+    uint64_t segment;
+};
+
+static const char durable_magic[8] = {'H', 'S', 'L', 'O', 'G', '\0', '\0', '\0'};
+static const uint32_t durable_version = 1;
+
+// Decorator that makes any set recoverable after a restart. Adds and removes that change the set are appended to an
+// in-memory buffer, which a background thread writes out and syncs a group at a time, so a write never waits for the
+// disk and lookups go straight to the wrapped set. Another background thread checkpoints the changed partitions.
+//
+// A write is durable once the flush after it has completed, or after sync(). Recovery in open() loads the checkpoint
+// and replays the log written since it, both in parallel, so restart time follows the checkpoint interval.
+template <typename T> class logged_set: public set<T> {
+
+    static constexpr int partitions = 256;
+
+    // Records buffered before a writer wakes the flusher early
+    static constexpr size_t group_size = 4096;
+
+    struct record {
+        uint32_t op;
+        T value;
+    };
+
+    private:
+
+        set<T>* inner;
+
+        std::string dir;
+
+        // Wall time between group commits, and between checkpoints
+        std::chrono::microseconds flush_interval;
+        std::chrono::milliseconds checkpoint_interval;
+
+        // Writers hold the stripe of their value's partition from applying a change until it is buffered, so the log
+        // has each value's changes in the order they were made
+        std::mutex stripes[partitions];
+
+        // Records not yet written
+        std::mutex appending;
+        std::vector<record> buffer;
+
+        // The open log segment; held while writing to it or switching segments
+        std::mutex file_lock;
+        int fd;
+        uint64_t segment;
+
+        // One checkpoint at a time, and the first segment the last one didn't cover
+        std::mutex checkpointing;
+        uint64_t covered;
+
+        std::mutex waiting;
+        std::condition_variable wake;
+        bool stopping;
+
+        std::thread flusher;
+        std::thread checkpointer;
+
+        // Set once any write to the log directory fails, after which nothing more is written
+        std::atomic<bool> failed;
+
+        static int partition_of(T value) {
+            return set<T>::mix(value) % partitions;
+        }
+
+        std::string path(const std::string& name, uint64_t n) {
+            return dir + "/" + name + "." + std::to_string(n);
+        }
+
+        static bool write_all(int out, const void* data, size_t length) {
+            const char* p = (const char*) data;
+
+            while (length > 0) {
+                ssize_t written = ::write(out, p, length);
+
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    return false;
+                }
+
+                p += written;
+                length -= written;
+            }
+
+            return true;
+        }
+
+        // Write <length> bytes to <name> through a temporary file, so a crash leaves either the old file or the new one
+        bool replace(const std::string& name, const void* data, size_t length) {
+            std::string temporary = name + ".tmp";
+
+            int out = ::open(temporary.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+            if (out < 0) {
+                return false;
+            }
+
+            bool ok = write_all(out, data, length) && fdatasync(out) == 0;
+            ok = ::close(out) == 0 && ok;
+
+            return ok && rename(temporary.c_str(), name.c_str()) == 0;
+        }
+
+        static bool read_file(const std::string& name, std::vector<char>& data) {
+            FILE* in = fopen(name.c_str(), "rb");
+            if (!in) {
+                return false;
+            }
+
+            char chunk[1 << 16];
+            size_t n;
+
+            while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+                data.insert(data.end(), chunk, chunk + n);
+            }
+
+            fclose(in);
+            return true;
+        }
+
+        // Append the records of segment <n> to <records>. A crash can tear the last record of a segment, which is dropped.
+        void read_segment(uint64_t n, std::vector<record>& records) {
+            std::vector<char> data;
+            read_file(path("log", n), data);
+
+            for (size_t i = 0; i + sizeof(record) <= data.size(); i += sizeof(record)) {
+                record r;
+                memcpy(&r, &data[i], sizeof(r));
+                records.push_back(r);
+            }
+        }
+
+        // Numbers of the log segments in the directory, in order
+        std::vector<uint64_t> segments() {
+            std::vector<uint64_t> found;
+
+            DIR* d = opendir(dir.c_str());
+            if (!d) {
+                return found;
+            }
+
+            while (dirent* e = readdir(d)) {
+                unsigned long long n;
+                char tail;
+
+                if (sscanf(e->d_name, "log.%llu%c", &n, &tail) == 1) {
+                    found.push_back(n);
+                }
+            }
+
+            closedir(d);
+            std::sort(found.begin(), found.end());
+            return found;
+        }
+
+        bool open_segment(uint64_t n) {
+            fd = ::open(path("log", n).c_str(), O_CREAT | O_APPEND | O_WRONLY, 0600);
+            segment = n;
+            return fd >= 0;
+        }
+
+        // Write out whatever is buffered and sync it. Called with <file_lock> held.
+        bool flush_locked() {
+            std::vector<record> pending;
+
+            {
+                std::unique_lock<std::mutex> held(appending);
+                pending.swap(buffer);
+            }
+
+            if (pending.empty() || failed) {
+                return !failed;
+            }
+
+            if (!write_all(fd, pending.data(), pending.size() * sizeof(record)) || fdatasync(fd) != 0) {
+                failed = true;
+            }
+
+            return !failed;
+        }
+
+        void log(uint32_t op, T value) {
+            bool full;
+
+            {
+                std::unique_lock<std::mutex> held(appending);
+                buffer.push_back({op, value});
+                full = buffer.size() >= group_size;
+            }
+
+            if (full) {
+                wake.notify_all();
+            }
+        }
+
+        // Load the checkpoint the manifest points at and replay the log segments from there on, spreading both over
+        // <threads> workers by partition. Values only ever meet the worker that owns their partition, so each one's
+        // changes are replayed in log order.
+        bool recover(int threads, std::string& error) {
+            uint64_t first = 0;
+            std::vector<char> data;
+
+            if (read_file(dir + "/manifest", data)) {
+                durable_manifest manifest;
+
+                if (data.size() != sizeof(manifest)) {
+                    error = dir + "/manifest is truncated";
+                    return false;
+                }
+
+                memcpy(&manifest, data.data(), sizeof(manifest));
+
+                if (memcmp(manifest.magic, durable_magic, sizeof(durable_magic)) != 0 || manifest.version != durable_version
+                        || manifest.partitions != partitions) {
+                    error = dir + "/manifest is not a version " + std::to_string(durable_version) + " manifest";
+                    return false;
+                }
+
+                first = manifest.segment;
+            }
+
+            // The log after the checkpoint, in the order it was written
+            std::vector<record> records;
+
+            for (uint64_t n : segments()) {
+                if (n < first) {
+                    continue;
+                }
+
+                read_segment(n, records);
+                segment = n + 1;
+            }
+
+            segment = std::max(segment, first);
+            covered = first;
+
+            // Make room for every checkpointed value and every logged add before the workers start, so they don't
+            // contend on resizes as the set fills up
+            size_t expected = 0;
+
+            for (int p = 0; p < partitions; p++) {
+                struct stat info;
+
+                if (stat(path("checkpoint", p).c_str(), &info) == 0) {
+                    expected += info.st_size / sizeof(T);
+                }
+            }
+
+            for (const record& r : records) {
+                expected += r.op == 'a';
+            }
+
+            inner->reserve(expected);
+
+            // Worker t owns partitions [t * span, (t + 1) * span) and replays the records for them in log order
+            int span = (partitions + threads - 1) / threads;
+            int owners = (partitions + span - 1) / span;
+
+            std::vector<std::vector<size_t>> replay(owners);
+            for (size_t i = 0; i < records.size(); i++) {
+                replay[partition_of(records[i].value) / span].push_back(i);
+            }
+
+            std::vector<std::thread> workers;
+            std::atomic<bool> broken(false);
+
+            for (int t = 0; t < owners; t++) {
+                workers.push_back(std::thread([&, t]() {
+                    for (int p = t * span; p < std::min((t + 1) * span, partitions); p++) {
+                        std::vector<char> image;
+
+                        if (!read_file(path("checkpoint", p), image)) {
+                            continue;
+                        }
+
+                        if (image.size() % sizeof(T) != 0) {
+                            broken = true;
+                            continue;
+                        }
+
+                        inner->insert_batch((const T*) image.data(), image.size() / sizeof(T));
+                    }
+
+                    for (size_t i : replay[t]) {
+                        T value = records[i].value;
+
+                        if (records[i].op == 'a') {
+                            inner->add(value);
+                        }
+                        else {
+                            inner->remove(value);
+                        }
+                    }
+                }));
+            }
+
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            if (broken) {
+                error = "a checkpoint in " + dir + " is truncated";
+                return false;
+            }
+
+            return true;
+        }
+
+        void flush_loop() {
+            std::unique_lock<std::mutex> held(waiting);
+
+            while (!stopping) {
+                wake.wait_for(held, flush_interval);
+
+                held.unlock();
+                {
+                    std::unique_lock<std::mutex> file(file_lock);
+                    flush_locked();
+                }
+                held.lock();
+            }
+        }
+
+        void checkpoint_loop() {
+            std::unique_lock<std::mutex> held(waiting);
+
+            while (!stopping) {
+                if (wake.wait_for(held, checkpoint_interval, [this]() { return stopping; })) {
+                    break;
+                }
+
+                held.unlock();
+                checkpoint();
+                held.lock();
+            }
+        }
+
+    public:
+
+        // Takes ownership of <inner>. Nothing is logged until open().
+        logged_set(set<T>* inner, int flush_interval_us = 1000, int checkpoint_interval_ms = 10000) {
+            this->inner = inner;
+            this->flush_interval = std::chrono::microseconds(flush_interval_us);
+            this->checkpoint_interval = std::chrono::milliseconds(checkpoint_interval_ms);
+
+            fd = -1;
+            segment = 0;
+            covered = 0;
+            stopping = false;
+            failed = false;
+        }
+
+        ~logged_set() {
+            close();
+            delete inner;
+        }
+
+        // Restore the set from <dir>, creating the directory if it doesn't exist, and start logging to it. Recovery
+        // runs with <threads> workers, which needs a thread-safe inner set above one. Returns false with a reason in
+        // <error> if the directory can't be used or what is in it can't be read.
+        bool open(const std::string& dir, int threads, std::string& error) {
+            this->dir = dir;
+
+            if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+                error = "can't create " + dir + ": " + strerror(errno);
+                return false;
+            }
+
+            if (!recover(std::max(1, threads), error)) {
+                return false;
+            }
+
+            // The replayed segments stay until the next checkpoint covers them, new records go into a fresh one
+            if (!open_segment(segment)) {
+                error = "can't open " + path("log", segment) + ": " + strerror(errno);
+                return false;
+            }
+
+            flusher = std::thread(&logged_set::flush_loop, this);
+            checkpointer = std::thread(&logged_set::checkpoint_loop, this);
+
+            return true;
+        }
+
+        // Stop the background threads, flushing the log but leaving the last checkpoint as it is
+        void close() {
+            {
+                std::unique_lock<std::mutex> held(waiting);
+                stopping = true;
+            }
+            wake.notify_all();
+
+            if (flusher.joinable()) {
+                flusher.join();
+            }
+            if (checkpointer.joinable()) {
+                checkpointer.join();
+            }
+
+            if (fd >= 0) {
+                std::unique_lock<std::mutex> file(file_lock);
+                flush_locked();
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        // Make every change so far durable. Returns false if writing the log has failed.
+        bool sync() {
+            std::unique_lock<std::mutex> file(file_lock);
+            return flush_locked();
+        }
+
+        // Write the partitions changed since the last checkpoint and move the manifest past the log they cover. Each
+        // changed partition's image is its previous checkpoint file with the partition's records since replayed onto
+        // it, so writers only wait while the log is cut and the set is never scanned. Returns false if any read or
+        // write failed.
+        bool checkpoint() {
+            std::unique_lock<std::mutex> one(checkpointing);
+            uint64_t cut;
+
+            {
+                std::unique_lock<std::mutex> file(file_lock);
+
+                if (failed || fd < 0) {
+                    return false;
+                }
+
+                // Everything logged so far goes into the segment being closed, later records into the next one. A
+                // writer part way through a change logs it after the cut, and the next checkpoint picks it up.
+                flush_locked();
+                ::close(fd);
+
+                if (!open_segment(segment + 1)) {
+                    failed = true;
+                    return false;
+                }
+                cut = segment;
+            }
+
+            // The records since the last checkpoint, each partition's in log order. With nothing changed the
+            // manifest is still moved on, so the segments just covered can go.
+            std::vector<std::vector<record>> changes(partitions);
+            std::vector<record> records;
+
+            for (uint64_t n : segments()) {
+                if (n >= covered && n < cut) {
+                    records.clear();
+                    read_segment(n, records);
+
+                    for (const record& r : records) {
+                        changes[partition_of(r.value)].push_back(r);
+                    }
+                }
+            }
+
+            // Each partition is written as soon as it is rebuilt, so at most one extra copy of a partition is held
+            bool ok = true;
+
+            for (int p = 0; p < partitions && ok; p++) {
+                if (changes[p].empty()) {
+                    continue;
+                }
+
+                std::vector<char> previous;
+                read_file(path("checkpoint", p), previous);
+
+                if (previous.size() % sizeof(T) != 0) {
+                    failed = true;
+                    return false;
+                }
+
+                std::unordered_set<T> members((const T*) previous.data(), (const T*) (previous.data() + previous.size()));
+
+                for (const record& r : changes[p]) {
+                    if (r.op == 'a') {
+                        members.insert(r.value);
+                    }
+                    else {
+                        members.erase(r.value);
+                    }
+                }
+
+                std::vector<T> image(members.begin(), members.end());
+                members.clear();
+
+                ok = replace(path("checkpoint", p), image.data(), image.size() * sizeof(T));
+            }
+
+            durable_manifest manifest;
+            memset(&manifest, 0, sizeof(manifest));
+            memcpy(manifest.magic, durable_magic, sizeof(manifest.magic));
+            manifest.version = durable_version;
+            manifest.partitions = partitions;
+            manifest.segment = cut;
+
+            ok = ok && replace(dir + "/manifest", &manifest, sizeof(manifest));
+
+            if (!ok) {
+                failed = true;
+                return false;
+            }
+
+            covered = cut;
+
+            // Segments before the cut are covered by the checkpoint now
+            for (uint64_t n : segments()) {
+                if (n < cut) {
+                    unlink(path("log", n).c_str());
+                }
+            }
+
+            return true;
+        }
+
+        bool add(T value) {
+            std::unique_lock<std::mutex> held(stripes[partition_of(value)]);
+
+            if (!inner->add(value)) {
+                return false;
+            }
+
+            log('a', value);
+            return true;
+        }
+
+        bool remove(T value) {
+            std::unique_lock<std::mutex> held(stripes[partition_of(value)]);
+
+            if (!inner->remove(value)) {
+                return false;
+            }
+
+            log('r', value);
+            return true;
+        }
+
+        bool contains(T value) {
+            return inner->contains(value);
+        }
+
+        void contains_batch(const T* values, size_t count, bool* found) {
+            inner->contains_batch(values, count, found);
+        }
+
+        size_t size() {
+            return inner->size();
+        }
+
+        // Generate random values until we've inserted pop items, logging each one
+        void populate(size_t pop, T (*random_t)()) {
+            for(size_t i = 0; i < pop; i++) {
+                while(!add(random_t()));
+            }
+        }
+
+        set_stats stats() {
+            return inner->stats();
+        }
+
+        size_t memory_usage() {
+            std::unique_lock<std::mutex> held(appending);
+            return sizeof(*this) + buffer.capacity() * sizeof(record) + inner->memory_usage();
+        }
+
+        // Growth only changes the layout, not the contents, so none of it is logged
+        void set_growth(const growth_policy& policy) {
+            inner->set_growth(policy);
+        }
+
+        void reserve(size_t count) {
+            inner->reserve(count);
+        }
+
+        bool grow() {
+            return inner->grow();
+        }
+
+        size_t buckets() {
+            return inner->buckets();
+        }
+
+        void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) {
+            inner->for_each_range(begin, end, fn);
+        }
+};
+
+#endif
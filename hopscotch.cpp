@@ -0,0 +1,730 @@
+#ifndef HOPSCOTCH_CPP
+#define HOPSCOTCH_CPP
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+#include "set.h"
+
+// Concurrent hopscotch set (Herlihy, Shavit and Tzafrir). Every value sits within <neighborhood> slots of its home
+// bucket, and the home bucket's hop bitmap records which of those slots hold its values. Writers lock the segment
+// covering the home bucket. Readers take no locks: they scan the bitmap and trust a miss only if the segment's
+// timestamp, which writers bump whenever they move a value between slots, didn't change underneath them. A resize
+// swaps in a new table while others may still be in the old one, which is freed once they have all left it.
+template <typename T> class hopscotch_set: public set<T> {
+
+    static constexpr int neighborhood = 32;
+
+    // Furthest from home an insertion looks for a free slot before resizing
+    static constexpr int add_range = 512;
+
+    // Lock-free attempts a reader makes before falling back to the segment lock
+    static constexpr int read_retries = 8;
+
+    // Load a reservation plans for when the growth policy allows more. Random fills first overflow a neighborhood at
+    // 0.8 to 0.9 depending on the table size, lower for larger tables, so this leaves some margin below that.
+    static constexpr double practical_load = 0.75;
+
+    static constexpr uint8_t empty_slot = 0;
+    static constexpr uint8_t claimed_slot = 1;
+    static constexpr uint8_t full_slot = 2;
+
+    // Fields are atomic because readers look at them without holding the segment lock
+    struct slot {
+        std::atomic<uint32_t> hop_info;
+        std::atomic<uint8_t> state;
+        std::atomic<T> value;
+
+        slot() : hop_info(0), state(empty_slot), value(T()) {}
+    };
+
+    struct alignas(64) segment {
+        std::mutex lock;
+        std::atomic<uint32_t> timestamp;
+
+        segment() : timestamp(0) {}
+    };
+
+    // Epoch a thread entered the set under, 0 when it isn't in it, see concurrent_set's read-mostly mode
+    struct alignas(64) reader_slot {
+        std::atomic<uint64_t> epoch;
+
+        reader_slot() : epoch(0) {}
+    };
+
+    // Threads that can be in the set with an epoch of their own at once, any more are only counted
+    static constexpr int max_readers = 256;
+
+    // Values counted in a few shards by home bucket for the load check, see concurrent_set
+    static constexpr int shards = 64;
+
+    struct alignas(64) shard_count {
+        std::atomic<int64_t> values;
+
+        shard_count() : values(0) {}
+    };
+
+    // One generation of the set. Buckets are [0, capacity); the slots run neighborhood - 1 further so a neighborhood
+    // never wraps around, which keeps segment locks ordered by bucket index. Indices are signed, displacement steps
+    // back from the free slot and may step past the start.
+    struct table {
+        int64_t capacity;
+        int64_t span;
+
+        std::vector<slot> slots;
+        std::vector<segment> segments;
+
+        shard_count filled[shards];
+
+        table(int64_t capacity, int num_segments) : slots(capacity + neighborhood - 1), segments(num_segments) {
+            this->capacity = capacity;
+            this->span = (capacity + num_segments - 1) / num_segments;
+        }
+
+        int segment_of(int64_t bucket) {
+            return bucket / span;
+        }
+
+        void counted(int64_t home, int change) {
+            filled[home % shards].values.fetch_add(change, std::memory_order_relaxed);
+        }
+
+        int64_t counted() {
+            int64_t count = 0;
+            for (auto& shard : filled) {
+                count += shard.values.load(std::memory_order_relaxed);
+            }
+
+            return count;
+        }
+    };
+
+    private:
+
+        std::atomic<table*> current;
+
+        // Tables a resize replaced, with the epoch each was replaced in. One is freed once no thread is still in the set
+        // under an earlier epoch, and none while any thread without an epoch of its own is in it.
+        std::mutex retiring;
+        std::vector<std::pair<table*, uint64_t>> retired;
+
+        std::atomic<uint64_t> epoch;
+        std::vector<reader_slot> readers;
+        std::atomic<int> unregistered;
+
+        // Set when reclaim() can use membarrier(), see pin
+        bool asymmetric;
+
+        int locks;
+
+#ifdef SET_STATS
+        set_counters counters;
+#endif
+
+        // Per-set hash salt, see robinhood_set
+        uint64_t salt;
+
+        int64_t hash(table* t, T value) {
+            return set<T>::mix((uint64_t) value ^ salt) % t->capacity;
+        }
+
+        std::unique_lock<std::mutex> lock(table* t, int index) {
+#ifdef SET_STATS
+            std::unique_lock<std::mutex> held(t->segments[index].lock, std::try_to_lock);
+
+            if (held.owns_lock()) {
+                counters.lock(index, false, 0);
+            }
+            else {
+                uint64_t started = set_counters::now();
+                held.lock();
+                counters.lock(index, true, set_counters::now() - started);
+            }
+
+            return held;
+#else
+            return std::unique_lock<std::mutex>(t->segments[index].lock);
+#endif
+        }
+
+        // Dense index for the calling thread into the reader slots, handed back when the thread exits. -1 when every
+        // slot is taken.
+        static int reader_id() {
+            static std::atomic<bool> taken[max_readers];
+
+            struct registration {
+                int id = -1;
+
+                registration() {
+                    for(int i = 0; i < max_readers && id < 0; i++) {
+                        bool expected = false;
+                        if (taken[i].compare_exchange_strong(expected, true)) {
+                            id = i;
+                        }
+                    }
+                }
+
+                ~registration() {
+                    if (id >= 0) {
+                        taken[id].store(false);
+                    }
+                }
+            };
+
+            // The registration has a destructor, so every access to it goes through a check that it was constructed.
+            // The id is kept in a plain thread_local too, which is free to read on the hot path.
+            thread_local int id = -2;
+
+            if (id == -2) {
+                thread_local registration self;
+                id = self.id;
+            }
+
+            return id;
+        }
+
+        // Announces the calling thread in the set for as long as it lives, so no table it can reach is freed. Every
+        // public operation holds exactly one before loading <current>. The announcement has to be visible before that
+        // load; with membarrier() reclaim() forces that on every thread at once, so each operation doesn't pay for a
+        // fence of its own.
+        class pin {
+
+                hopscotch_set* owner;
+                int id;
+
+            public:
+
+                pin(hopscotch_set* owner) : owner(owner), id(reader_id()) {
+                    if (id < 0) {
+                        owner->unregistered++;
+                        return;
+                    }
+
+                    uint64_t e = owner->epoch.load(std::memory_order_acquire);
+
+                    if (owner->asymmetric) {
+                        owner->readers[id].epoch.store(e, std::memory_order_relaxed);
+                        std::atomic_signal_fence(std::memory_order_seq_cst);
+                    }
+                    else {
+                        owner->readers[id].epoch.store(e);
+                    }
+                }
+
+                ~pin() {
+                    if (id < 0) {
+                        owner->unregistered--;
+                    }
+                    else {
+                        owner->readers[id].epoch.store(0, std::memory_order_release);
+                    }
+                }
+        };
+
+        // Whether membarrier() can stand in for the fence in pin, registering the process for it the first time
+        static bool expedited_barrier() {
+            static bool registered = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+            return registered;
+        }
+
+        // Free the retired tables no thread can still be in
+        void reclaim() {
+            std::unique_lock<std::mutex> held(retiring);
+
+            // Every thread's announcement so far is visible from here on
+            if (!asymmetric || syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) != 0) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+
+            if (unregistered.load() > 0) {
+                return;
+            }
+
+            uint64_t oldest = UINT64_MAX;
+            for (auto& reader : readers) {
+                uint64_t e = reader.epoch.load();
+
+                if (e != 0 && e < oldest) {
+                    oldest = e;
+                }
+            }
+
+            auto done = std::remove_if(retired.begin(), retired.end(), [oldest](std::pair<table*, uint64_t>& r) {
+                if (r.second <= oldest) {
+                    delete r.first;
+                    return true;
+                }
+
+                return false;
+            });
+            retired.erase(done, retired.end());
+        }
+
+        // Lock the segment of <value>'s home bucket in the current table. A resize swaps the table, so if one happened
+        // while we waited we let go and try again.
+        std::unique_lock<std::mutex> acquire(T value, table*& t, int64_t& home) {
+            for (;;) {
+                t = current.load();
+                home = hash(t, value);
+
+                std::unique_lock<std::mutex> held = lock(t, t->segment_of(home));
+
+                if (t == current.load()) {
+                    return held;
+                }
+            }
+        }
+
+        // Slot holding <value> in the neighborhood of <home>, or -1
+        int64_t find(table* t, int64_t home, T value) {
+            uint32_t hop = t->slots[home].hop_info.load();
+
+            for(int d = 0; hop; d++, hop >>= 1) {
+                if ((hop & 1) && t->slots[home + d].state.load() == full_slot && t->slots[home + d].value.load() == value) {
+                    return home + d;
+                }
+            }
+
+            return -1;
+        }
+
+        // Put <value> into the neighborhood of <home>, displacing values towards their own homes to bring a free slot
+        // close enough. The caller holds <home>'s segment, or owns <t> outright. Returns false if there is no free slot
+        // within add_range or it can't be brought close enough, in which case the table needs to grow.
+        bool place(table* t, int64_t home, T value, bool locked) {
+            int64_t free = -1;
+            int64_t end = std::min(home + add_range, (int64_t) t->slots.size());
+
+            // Claim the nearest free slot. Another writer probing from a different home may be after it too.
+            for(int64_t i = home; i < end; i++) {
+                uint8_t expected = empty_slot;
+                if (t->slots[i].state.load() == empty_slot && t->slots[i].state.compare_exchange_strong(expected, claimed_slot)) {
+                    free = i;
+                    break;
+                }
+            }
+
+            if (free < 0) {
+                return false;
+            }
+
+            // Number of values we've displaced so far
+            int path = 0;
+
+            while (free - home >= neighborhood) {
+                bool moved = false;
+
+                // The furthest bucket back whose neighborhood still reaches the free slot goes first, it frees a slot
+                // the most steps closer. Its segment is never before home's, so locks are taken in bucket order.
+                for(int64_t b = free - (neighborhood - 1); b < free && b < t->capacity && !moved; b++) {
+                    std::unique_lock<std::mutex> other;
+                    int s = t->segment_of(b);
+
+                    if (locked && s != t->segment_of(home)) {
+                        other = lock(t, s);
+                    }
+
+                    uint32_t hop = t->slots[b].hop_info.load();
+
+                    for(int d = 0; d < free - b; d++) {
+                        if (!(hop & (1u << d))) {
+                            continue;
+                        }
+
+                        int64_t from = b + d;
+
+                        // Copy the value forward before unlinking it from its old slot, so it is always findable. The
+                        // timestamp tells readers that missed it mid-move to look again.
+                        t->slots[free].value.store(t->slots[from].value.load());
+                        t->slots[free].state.store(full_slot);
+                        t->slots[b].hop_info.fetch_or(1u << (free - b));
+                        t->slots[b].hop_info.fetch_and(~(1u << d));
+                        t->segments[s].timestamp.fetch_add(1);
+                        t->slots[from].state.store(claimed_slot);
+
+                        free = from;
+                        moved = true;
+                        path++;
+                        break;
+                    }
+                }
+
+                if (!moved) {
+                    t->slots[free].state.store(empty_slot);
+                    return false;
+                }
+            }
+
+            t->slots[free].value.store(value);
+            t->slots[free].state.store(full_slot);
+            t->slots[home].hop_info.fetch_or(1u << (free - home));
+
+#ifdef SET_STATS
+            counters.path(path);
+#endif
+
+            return true;
+        }
+
+        // Whether <t> has passed the policy's maximum load, totalling the shards only once <home>'s is past its share
+        bool full(table* t, int64_t home) {
+            if (set<T>::growth.max_load >= 1) {
+                return false;
+            }
+
+            double limit = set<T>::growth.max_load * t->capacity;
+            return t->filled[home % shards].values.load(std::memory_order_relaxed) > limit / shards && t->counted() > limit;
+        }
+
+        void resize(table* old) {
+            resize(old, set<T>::growth.next(old->capacity));
+        }
+
+        // Rebuild <old> with at least <capacity> buckets, unless someone already replaced it. Capacities past it are
+        // tried in growth steps until every value finds a slot.
+        void resize(table* old, int64_t capacity) {
+            // Holding every segment keeps all writers out; readers carry on in the old table
+            std::vector<std::unique_lock<std::mutex>> held;
+            for(int i = 0; i < locks; i++) {
+                held.push_back(lock(old, i));
+            }
+
+            if (old != current.load()) {
+                return;
+            }
+
+#ifdef SET_STATS
+            uint64_t started = set_counters::now();
+#endif
+
+            table* t = NULL;
+
+            for(; t == NULL; capacity = set<T>::growth.next(capacity)) {
+                t = new table(capacity, locks);
+
+                // Nobody else can see the new table yet, so values go in without locks
+                for(size_t i = 0; i < old->slots.size() && t; i++) {
+                    if (old->slots[i].state.load() == full_slot) {
+                        T value = old->slots[i].value.load();
+                        int64_t home = hash(t, value);
+
+                        if (place(t, home, value, false)) {
+                            t->counted(home, 1);
+                        }
+                        else {
+                            delete t;
+                            t = NULL;
+                        }
+                    }
+                }
+            }
+
+            // A thread that announces the new epoch loaded <current> after the swap, so only those announcing an
+            // older one can still be in the table we replace
+            current.store(t);
+            uint64_t replaced = epoch.fetch_add(1) + 1;
+
+            {
+                std::unique_lock<std::mutex> list(retiring);
+                retired.emplace_back(old, replaced);
+            }
+
+            // Readers that missed in the old table look again, in the new one
+            for(int i = 0; i < locks; i++) {
+                old->segments[i].timestamp.fetch_add(1);
+            }
+
+#ifdef SET_STATS
+            counters.resize(set_counters::now() - started);
+#endif
+        }
+
+        // contains() once in the set
+        bool lookup(T value) {
+            for(int attempt = 0; attempt < read_retries; attempt++) {
+                table* t = current.load();
+                int64_t home = hash(t, value);
+
+                segment& seg = t->segments[t->segment_of(home)];
+                uint32_t timestamp = seg.timestamp.load();
+
+                if (find(t, home, value) >= 0) {
+                    return true;
+                }
+
+                // Nothing moved while we looked, so the miss is genuine
+                if (seg.timestamp.load() == timestamp) {
+                    return false;
+                }
+            }
+
+            // Values keep moving under us, look with the segment held
+            table* t;
+            int64_t home;
+
+            std::unique_lock<std::mutex> held = acquire(value, t, home);
+
+            return find(t, home, value) >= 0;
+        }
+
+        // add() while in the set, noting whether it had to resize
+        bool insert(T value, bool& resized) {
+            pin in(this);
+
+            for (;;) {
+                table* t;
+                int64_t home;
+                bool placed = false;
+
+                {
+                    std::unique_lock<std::mutex> held = acquire(value, t, home);
+
+                    // If the table already contains the value return false
+                    if (find(t, home, value) >= 0) {
+                        return false;
+                    }
+
+                    if (place(t, home, value, true)) {
+                        t->counted(home, 1);
+
+                        if (!full(t, home)) {
+                            return true;
+                        }
+
+                        placed = true;
+                    }
+                }
+
+                // Either there was no room or the segment passed the maximum load, grow before going on
+                resize(t);
+                resized = true;
+
+                if (placed) {
+                    return true;
+                }
+            }
+        }
+
+        size_t table_bytes(table* t) {
+            return sizeof(table) + t->slots.capacity() * sizeof(slot) + t->segments.capacity() * sizeof(segment);
+        }
+
+    public:
+
+        hopscotch_set(size_t size, int num_locks)
+            : epoch(1), readers(max_readers), unregistered(0), asymmetric(expedited_barrier())
+#ifdef SET_STATS
+            , counters(std::min((size_t) num_locks, size))
+#endif
+        {
+            static std::atomic<uint64_t> instances(0);
+            salt = (instances++ + 1) * 0x9e3779b97f4a7c15ull;
+
+            // Every segment needs at least one bucket
+            this->locks = std::min((size_t) num_locks, size);
+
+            current = new table(size, locks);
+        }
+
+        ~hopscotch_set() {
+            delete current.load();
+
+            for (auto& r : retired) {
+                delete r.first;
+            }
+        }
+
+        bool add(T value) {
+            bool resized = false;
+            bool added = insert(value, resized);
+
+            // Out of the set again, so the tables our resizes replaced can go unless someone else is still in them
+            if (resized) {
+                reclaim();
+            }
+
+            return added;
+        }
+
+        bool remove(T value) {
+            pin in(this);
+            table* t;
+            int64_t home;
+
+            std::unique_lock<std::mutex> held = acquire(value, t, home);
+
+            int64_t index = find(t, home, value);
+
+            if (index < 0) {
+                return false;
+            }
+
+            t->slots[home].hop_info.fetch_and(~(1u << (index - home)));
+            t->slots[index].state.store(empty_slot);
+            t->counted(home, -1);
+
+            return true;
+        }
+
+        bool contains(T value) {
+            pin in(this);
+            return lookup(value);
+        }
+
+        void contains_batch(const T* values, size_t count, bool* found) {
+            pin in(this);
+
+            for(size_t begin = 0; begin < count; begin += set<T>::batch_size) {
+                int n = std::min(count - begin, (size_t) set<T>::batch_size);
+                table* t = current.load();
+
+                for(int b = 0; b < n; b++) {
+                    __builtin_prefetch(&t->slots[hash(t, values[begin + b])]);
+                }
+
+                for(int b = 0; b < n; b++) {
+                    found[begin + b] = lookup(values[begin + b]);
+                }
+            }
+        }
+
+        size_t size() {
+            pin in(this);
+            table* t = current.load();
+            size_t count = 0;
+
+            for (auto& s : t->slots) {
+                count += s.state.load() == full_slot;
+            }
+
+            return count;
+        }
+
+        // Generate random values until we've inserted pop items
+        void populate(size_t pop, T (*random_t)()) {
+            for(size_t i = 0; i < pop; i++) {
+                while(!add(random_t()));
+            }
+        }
+
+        set_stats stats() {
+            set_stats s;
+            pin in(this);
+            table* t = current.load();
+
+            // Every slot is a bucket that holds zero or one value
+            s.occupancy = std::vector<uint64_t>(2);
+            for (auto& entry : t->slots) {
+                s.occupancy[entry.state.load() == full_slot]++;
+            }
+
+            s.capacity = t->slots.size();
+            s.load_factor = (double) s.occupancy[1] / s.capacity;
+
+#ifdef SET_STATS
+            counters.fill(s);
+#endif
+
+            return s;
+        }
+
+        // Counts the retired tables not freed yet, and the reader slots
+        size_t memory_usage() {
+            pin in(this);
+            size_t bytes = sizeof(*this) + table_bytes(current.load()) + readers.capacity() * sizeof(reader_slot);
+
+            std::unique_lock<std::mutex> held(retiring);
+            for (auto& r : retired) {
+                bytes += table_bytes(r.first);
+            }
+
+            return bytes;
+        }
+
+        void reserve(size_t count) {
+            int64_t capacity = set<T>::buckets_for(count, std::min(set<T>::growth.max_load, practical_load), 1);
+
+            {
+                pin in(this);
+
+                for (table* t = current.load(); t->capacity < capacity; t = current.load()) {
+                    resize(t, capacity);
+                }
+            }
+
+            // Called while the set is quiet, so the tables just replaced can usually go right away
+            reclaim();
+        }
+
+        bool grow() {
+            {
+                pin in(this);
+                table* t = current.load();
+
+                if (set<T>::growth.idle_load <= 0 || t->counted() <= set<T>::growth.idle_load * t->capacity) {
+                    return false;
+                }
+
+                resize(t);
+            }
+
+            reclaim();
+            return true;
+        }
+
+        size_t buckets() {
+            pin in(this);
+            return current.load()->capacity;
+        }
+
+        // Visits each value through its home bucket, with the bucket's segment held while its neighborhood is copied
+        void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) {
+            std::vector<T> neighbors;
+
+            for(int64_t i = begin; i < (int64_t) end; i++) {
+                neighbors.clear();
+
+                {
+                    pin in(this);
+                    table* t;
+                    std::unique_lock<std::mutex> held;
+
+                    for (;;) {
+                        t = current.load();
+                        if (i >= t->capacity) {
+                            return;
+                        }
+
+                        held = lock(t, t->segment_of(i));
+
+                        if (t == current.load()) {
+                            break;
+                        }
+                        held.unlock();
+                    }
+
+                    uint32_t hop = t->slots[i].hop_info.load();
+
+                    for(int d = 0; hop; d++, hop >>= 1) {
+                        if ((hop & 1) && t->slots[i + d].state.load() == full_slot) {
+                            neighbors.push_back(t->slots[i + d].value.load());
+                        }
+                    }
+                }
+
+                for (T value : neighbors) {
+                    fn(value);
+                }
+            }
+        }
+};
+
+#endif
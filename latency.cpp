@@ -0,0 +1,115 @@
+#ifndef LATENCY_CPP
+#define LATENCY_CPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Log-linear latency histogram. Each power of two is split into a fixed number of linear sub-buckets, so recording is
+// constant time and the relative error of any reported percentile is bounded by 1 / sub_buckets.
+class latency_histogram {
+
+    private:
+
+        static const int sub_bits = 4;
+        static const int sub_buckets = 1 << sub_bits;
+        static const int major_buckets = 64 - sub_bits;
+
+        std::vector<uint64_t> counts;
+
+        uint64_t total;
+        uint64_t sum;
+        uint64_t max_value;
+
+        static int bucket_of(uint64_t value) {
+            if (value < sub_buckets) {
+                return value;
+            }
+
+            // Position of the highest set bit decides the major bucket, the next sub_bits bits the sub-bucket
+            int major = 63 - __builtin_clzll(value) - sub_bits + 1;
+            int sub = (value >> (major - 1)) & (sub_buckets - 1);
+
+            return major * sub_buckets + sub;
+        }
+
+        // Upper bound of the values that land in a bucket
+        static uint64_t value_of(int bucket) {
+            int major = bucket / sub_buckets;
+            int sub = bucket % sub_buckets;
+
+            if (major == 0) {
+                return sub;
+            }
+
+            return ((uint64_t) (sub_buckets + sub + 1) << (major - 1)) - 1;
+        }
+
+    public:
+
+        latency_histogram() {
+            counts = std::vector<uint64_t>((major_buckets + 1) * sub_buckets);
+            total = 0;
+            sum = 0;
+            max_value = 0;
+        }
+
+        void record(uint64_t value) {
+            counts[bucket_of(value)]++;
+            total++;
+            sum += value;
+
+            if (value > max_value) {
+                max_value = value;
+            }
+        }
+
+        void merge(const latency_histogram& other) {
+            for (size_t i = 0; i < counts.size(); i++) {
+                counts[i] += other.counts[i];
+            }
+
+            total += other.total;
+            sum += other.sum;
+
+            if (other.max_value > max_value) {
+                max_value = other.max_value;
+            }
+        }
+
+        // Smallest recorded bucket value such that at least p percent of samples are at or below it
+        uint64_t percentile(double p) const {
+            if (total == 0) {
+                return 0;
+            }
+
+            uint64_t rank = (uint64_t) ((p / 100.0) * total);
+            if (rank == 0) {
+                rank = 1;
+            }
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return value_of(i) < max_value ? value_of(i) : max_value;
+                }
+            }
+
+            return max_value;
+        }
+
+        uint64_t count() const {
+            return total;
+        }
+
+        uint64_t max() const {
+            return max_value;
+        }
+
+        double mean() const {
+            return total ? (double) sum / total : 0;
+        }
+};
+
+#endif
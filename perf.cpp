@@ -0,0 +1,150 @@
+#ifndef PERF_CPP
+#define PERF_CPP
+
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum perf_event_t {
+    cycles_event = 0,
+    instructions_event,
+    llc_misses_event,
+    dtlb_misses_event,
+    branch_misses_event,
+    perf_events
+};
+
+static const char* perf_event_names[] = {"cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"};
+
+// Totals of the hardware counters across threads. A counter any thread couldn't open is reported as unavailable
+// rather than as a partial sum.
+struct perf_totals {
+    uint64_t values[perf_events];
+    bool available[perf_events];
+    bool enabled;
+
+    perf_totals() {
+        enabled = false;
+        for (int e = 0; e < perf_events; e++) {
+            values[e] = 0;
+            available[e] = true;
+        }
+    }
+};
+
+// Hardware counters for the calling thread. Each event is opened on its own rather than as a group so one the PMU or
+// kernel refuses (no access, virtualised hardware, not supported) doesn't take the others down with it; the kernel
+// multiplexes them if there aren't enough hardware counters and read() scales the counts back up.
+class perf_counters {
+
+    private:
+
+        int fds[perf_events];
+
+        bool enabled;
+
+        static int open_event(uint32_t type, uint64_t config) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // This thread, any cpu
+            return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+
+        static uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result) {
+            return cache | (op << 8) | (result << 16);
+        }
+
+    public:
+
+        perf_counters(bool enabled) {
+            this->enabled = enabled;
+
+            for (int e = 0; e < perf_events; e++) {
+                fds[e] = -1;
+            }
+
+            if (!enabled) {
+                return;
+            }
+
+            fds[cycles_event] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            fds[instructions_event] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            fds[llc_misses_event] = open_event(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+            fds[dtlb_misses_event] = open_event(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+            fds[branch_misses_event] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+            for (int e = 0; e < perf_events; e++) {
+                if (fds[e] >= 0) {
+                    ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+                    ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+        }
+
+        ~perf_counters() {
+            for (int e = 0; e < perf_events; e++) {
+                if (fds[e] >= 0) {
+                    close(fds[e]);
+                }
+            }
+        }
+
+        bool active() {
+            return enabled;
+        }
+
+        // Stop counting, resume() carries on from the counts so far
+        void stop() {
+            for (int e = 0; e < perf_events; e++) {
+                if (fds[e] >= 0) {
+                    ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+                }
+            }
+        }
+
+        void resume() {
+            for (int e = 0; e < perf_events; e++) {
+                if (fds[e] >= 0) {
+                    ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+        }
+
+        // Add this thread's counts to <totals>
+        void collect(perf_totals& totals) {
+            for (int e = 0; e < perf_events; e++) {
+                // value, time enabled, time running
+                uint64_t data[3];
+
+                // A counter that never got scheduled onto the PMU tells us nothing
+                if (fds[e] < 0 || read(fds[e], data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+                    totals.available[e] = false;
+                    continue;
+                }
+
+                // Scale up counts for the share of time the event was multiplexed off the PMU
+                if (data[2] > 0 && data[2] < data[1]) {
+                    data[0] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+                }
+
+                totals.values[e] += data[0];
+            }
+
+            totals.enabled = true;
+        }
+};
+
+#endif
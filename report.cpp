@@ -0,0 +1,265 @@
+#ifndef REPORT_CPP
+#define REPORT_CPP
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+
+// Summary of repeated measurements of one quantity
+struct sample_stats {
+    int n;
+    double mean;
+    double stddev;
+
+    // Half-width of the 95% confidence interval of the mean
+    double ci95;
+
+    sample_stats(const std::vector<double>& samples) {
+        n = samples.size();
+        mean = 0;
+        stddev = 0;
+        ci95 = 0;
+
+        if (n == 0) {
+            return;
+        }
+
+        for (double s : samples) {
+            mean += s;
+        }
+        mean /= n;
+
+        if (n < 2) {
+            return;
+        }
+
+        for (double s : samples) {
+            stddev += (s - mean) * (s - mean);
+        }
+        stddev = sqrt(stddev / (n - 1));
+
+        ci95 = t_critical(n - 1) * stddev / sqrt(n);
+    }
+
+    // Two-sided 95% critical value of Student's t distribution
+    static double t_critical(int df) {
+        static const double table[] = {
+            12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+            2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+            2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+        };
+
+        if (df < 1) {
+            return 0;
+        }
+
+        return df <= 30 ? table[df - 1] : 1.96;
+    }
+};
+
+// One point of a benchmark sweep: the configuration that was measured and the statistics over its trials
+struct result_row {
+    std::string implementation;
+    int threads;
+    double load_factor;
+    long population;
+    long operations;
+
+    int trials;
+    double throughput_mean;
+    double throughput_stddev;
+    double throughput_ci95;
+    double time_mean;
+    double p99_mean;
+
+    std::string key() const {
+        std::ostringstream out;
+        out << implementation << "/t" << threads << "/lf" << load_factor;
+        return out.str();
+    }
+};
+
+class report {
+
+    private:
+
+        static const char* columns() {
+            return "implementation,threads,load_factor,population,operations,trials,throughput_mean,throughput_stddev,throughput_ci95,time_mean_us,p99_mean_us";
+        }
+
+        // Pull the value of "<name>": out of a flat JSON object
+        static std::string json_field(const std::string& object, const std::string& name) {
+            size_t at = object.find("\"" + name + "\"");
+            if (at == std::string::npos) {
+                return "";
+            }
+
+            size_t begin = object.find(':', at) + 1;
+            while (begin < object.size() && (object[begin] == ' ' || object[begin] == '"')) {
+                begin++;
+            }
+
+            size_t end = object.find_first_of(",\"}", begin);
+            return object.substr(begin, end - begin);
+        }
+
+    public:
+
+        static void write_csv(const std::vector<result_row>& rows, std::ostream& out) {
+            out << columns() << std::endl;
+
+            for (const result_row& r : rows) {
+                out << r.implementation << "," << r.threads << "," << r.load_factor << "," << r.population << ","
+                    << r.operations << "," << r.trials << "," << std::fixed << std::setprecision(1)
+                    << r.throughput_mean << "," << r.throughput_stddev << "," << r.throughput_ci95 << ","
+                    << r.time_mean << "," << r.p99_mean << std::defaultfloat << std::setprecision(6) << std::endl;
+            }
+        }
+
+        static void write_json(const std::vector<result_row>& rows, std::ostream& out) {
+            out << "[" << std::endl;
+
+            for (size_t i = 0; i < rows.size(); i++) {
+                const result_row& r = rows[i];
+
+                out << "  {\"implementation\": \"" << r.implementation << "\", \"threads\": " << r.threads
+                    << ", \"load_factor\": " << r.load_factor << ", \"population\": " << r.population
+                    << ", \"operations\": " << r.operations << ", \"trials\": " << r.trials
+                    << std::fixed << std::setprecision(1)
+                    << ", \"throughput_mean\": " << r.throughput_mean << ", \"throughput_stddev\": " << r.throughput_stddev
+                    << ", \"throughput_ci95\": " << r.throughput_ci95 << ", \"time_mean_us\": " << r.time_mean
+                    << ", \"p99_mean_us\": " << r.p99_mean << std::defaultfloat << std::setprecision(6)
+                    << "}" << (i + 1 < rows.size() ? "," : "") << std::endl;
+            }
+
+            out << "]" << std::endl;
+        }
+
+        static void write_text(const std::vector<result_row>& rows, std::ostream& out) {
+            out << std::setw(15) << "implementation" << std::setw(9) << "threads" << std::setw(8) << "load"
+                << std::setw(8) << "trials" << std::setw(14) << "ops/sec" << std::setw(12) << "stddev"
+                << std::setw(12) << "ci95" << std::endl;
+
+            for (const result_row& r : rows) {
+                out << std::setw(15) << r.implementation << std::setw(9) << r.threads << std::setw(8) << r.load_factor
+                    << std::setw(8) << r.trials << std::setw(14) << (long) r.throughput_mean
+                    << std::setw(12) << (long) r.throughput_stddev << std::setw(12) << (long) r.throughput_ci95 << std::endl;
+            }
+        }
+
+        // Read back a file written by write_csv or write_json. Returns false if it can't be opened or holds no rows,
+        // which is also what a write_text report reads as.
+        static bool read(const std::string& path, std::vector<result_row>& rows) {
+            std::ifstream in(path);
+            if (!in) {
+                return false;
+            }
+
+            std::string line;
+
+            while (std::getline(in, line)) {
+                result_row r;
+
+                if (line.find('{') != std::string::npos) {
+                    r.implementation = json_field(line, "implementation");
+                    r.threads = atoi(json_field(line, "threads").c_str());
+                    r.load_factor = atof(json_field(line, "load_factor").c_str());
+                    r.population = atol(json_field(line, "population").c_str());
+                    r.operations = atol(json_field(line, "operations").c_str());
+                    r.trials = atoi(json_field(line, "trials").c_str());
+                    r.throughput_mean = atof(json_field(line, "throughput_mean").c_str());
+                    r.throughput_stddev = atof(json_field(line, "throughput_stddev").c_str());
+                    r.throughput_ci95 = atof(json_field(line, "throughput_ci95").c_str());
+                    r.time_mean = atof(json_field(line, "time_mean_us").c_str());
+                    r.p99_mean = atof(json_field(line, "p99_mean_us").c_str());
+                }
+                else if (!line.empty() && line != columns() && line[0] != '[' && line[0] != ']') {
+                    std::stringstream fields(line);
+                    std::string field;
+                    std::vector<std::string> values;
+
+                    while (std::getline(fields, field, ',')) {
+                        values.push_back(field);
+                    }
+
+                    if (values.size() < 11) {
+                        continue;
+                    }
+
+                    r.implementation = values[0];
+                    r.threads = atoi(values[1].c_str());
+                    r.load_factor = atof(values[2].c_str());
+                    r.population = atol(values[3].c_str());
+                    r.operations = atol(values[4].c_str());
+                    r.trials = atoi(values[5].c_str());
+                    r.throughput_mean = atof(values[6].c_str());
+                    r.throughput_stddev = atof(values[7].c_str());
+                    r.throughput_ci95 = atof(values[8].c_str());
+                    r.time_mean = atof(values[9].c_str());
+                    r.p99_mean = atof(values[10].c_str());
+                }
+                else {
+                    continue;
+                }
+
+                rows.push_back(r);
+            }
+
+            return !rows.empty();
+        }
+
+        // Match rows by configuration and flag every point where the candidate's throughput dropped by more than
+        // <threshold> percent and the drop is larger than the two confidence intervals combined. Baseline
+        // configurations the candidate didn't measure are listed and counted in <missing>. Returns the number of
+        // regressions found.
+        static int compare(const std::vector<result_row>& baseline, const std::vector<result_row>& candidate, double threshold, std::ostream& out, int& missing) {
+            int regressions = 0;
+            missing = 0;
+
+            out << std::setw(30) << "configuration" << std::setw(14) << "baseline" << std::setw(14) << "candidate"
+                << std::setw(10) << "change" << std::setw(12) << "verdict" << std::endl;
+
+            for (const result_row& b : baseline) {
+                bool matched = false;
+
+                for (const result_row& c : candidate) {
+                    if (b.key() != c.key()) {
+                        continue;
+                    }
+
+                    matched = true;
+
+                    double change = b.throughput_mean > 0 ? 100.0 * (c.throughput_mean - b.throughput_mean) / b.throughput_mean : 0;
+                    double noise = b.throughput_ci95 + c.throughput_ci95;
+                    double delta = c.throughput_mean - b.throughput_mean;
+
+                    const char* verdict = "ok";
+                    if (change < -threshold && -delta > noise) {
+                        verdict = "REGRESSION";
+                        regressions++;
+                    }
+                    else if (change > threshold && delta > noise) {
+                        verdict = "improved";
+                    }
+
+                    out << std::setw(30) << b.key() << std::setw(14) << (long) b.throughput_mean << std::setw(14)
+                        << (long) c.throughput_mean << std::setw(9) << std::fixed << std::setprecision(1) << change
+                        << "%" << std::defaultfloat << std::setprecision(6) << std::setw(12) << verdict << std::endl;
+                }
+
+                if (!matched) {
+                    out << std::setw(30) << b.key() << std::setw(14) << (long) b.throughput_mean << std::setw(14) << "-"
+                        << std::setw(10) << "-" << std::setw(12) << "MISSING" << std::endl;
+                    missing++;
+                }
+            }
+
+            return regressions;
+        }
+};
+
+#endif
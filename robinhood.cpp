@@ -0,0 +1,286 @@
+#ifndef ROBINHOOD_CPP
+#define ROBINHOOD_CPP
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+
+#include "set.h"
+
+// Open-addressing set with linear probing and Robin Hood displacement: an insertion takes the slot of any value that
+// sits closer to its home slot than the insertion already is, so probe distances stay short and even. Deletion shifts
+// the following values back one slot instead of leaving tombstones. Single threaded like sequential_set.
+template <typename T> class robinhood_set: public set<T> {
+
+    // Slot entry. <distance> is how far the value sits from its home slot, -1 when the slot is empty.
+    struct entry {
+        T value;
+        int32_t distance;
+    };
+
+    // Most of the slots the set lets fill, whatever the growth policy says. Probes and backward shifts only stop at
+    // empty or at-home slots, so a fuller table makes them run long.
+    static constexpr double max_load = 0.9;
+
+    private:
+
+        // Number of slots, always a power of two
+        size_t set_size;
+        size_t mask;
+
+        size_t count;
+
+        entry* table;
+
+#ifdef SET_STATS
+        set_counters counters;
+#endif
+
+        // Mixed into every hash so two sets order their values differently. Copying one set into another in slot order
+        // otherwise feeds it keys in its own probe order, which piles them all into one ever-growing cluster.
+        uint64_t salt;
+
+        // Linear probing needs the low bits well mixed, a plain modulo would cluster runs of keys
+        size_t hash(T value) {
+            return set<T>::mix((uint64_t) value ^ salt) & mask;
+        }
+
+        // Slot holding <value>, or -1. The probe stops at the first slot whose value is closer to home than we are,
+        // since Robin Hood ordering means <value> would have taken that slot.
+        int64_t find(T value) {
+            size_t index = hash(value);
+
+            for(int distance = 0; table[index].distance >= distance; distance++) {
+                if (table[index].value == value) {
+                    return index;
+                }
+
+                index = (index + 1) & mask;
+            }
+
+            return -1;
+        }
+
+        // Place a value known not to be in the table
+        void insert(T value) {
+            size_t index = hash(value);
+            int distance = 0;
+
+            // Number of values we've displaced so far
+            int path = 0;
+
+            for (;;) {
+                if (table[index].distance < 0) {
+                    table[index].value = value;
+                    table[index].distance = distance;
+                    count++;
+#ifdef SET_STATS
+                    counters.path(path);
+#endif
+                    return;
+                }
+
+                // Take from the rich: the resident is closer to home than we are, so it moves on instead
+                if (table[index].distance < distance) {
+                    std::swap(table[index].value, value);
+                    std::swap(table[index].distance, distance);
+                    path++;
+                }
+
+                index = (index + 1) & mask;
+                distance++;
+            }
+        }
+
+        double load_limit() {
+            return std::min(set<T>::growth.max_load, max_load);
+        }
+
+        // Grow to the power of two at or above the policy's next size, which makes every step at least a doubling
+        void resize() {
+            resize(set<T>::growth.next(set_size));
+        }
+
+        void resize(size_t size) {
+#ifdef SET_STATS
+            uint64_t started = set_counters::now();
+#endif
+
+            size_t size_old = set_size;
+            entry* table_old = table;
+
+            allocate(round_up(size));
+
+            for(size_t i = 0; i < size_old; i++) {
+                if (table_old[i].distance >= 0) {
+                    insert(table_old[i].value);
+                }
+            }
+
+            delete[] table_old;
+
+#ifdef SET_STATS
+            counters.resize(set_counters::now() - started);
+#endif
+        }
+
+        void allocate(size_t size) {
+            set_size = size;
+            mask = size - 1;
+            count = 0;
+
+            table = new entry[set_size];
+
+            for(size_t i = 0; i < set_size; i++) {
+                table[i].distance = -1;
+            }
+        }
+
+        // Sizes are powers of two so the hash can mask instead of divide
+        static size_t round_up(size_t size) {
+            size_t slots = 1;
+            while (slots < size) {
+                slots *= 2;
+            }
+
+            return slots;
+        }
+
+    public:
+
+        robinhood_set(size_t size) {
+            static std::atomic<uint64_t> instances(0);
+            salt = (instances++ + 1) * 0x9e3779b97f4a7c15ull;
+
+            allocate(round_up(size));
+        }
+
+        ~robinhood_set() {
+            delete[] table;
+        }
+
+        bool add(T value) {
+            // If the table already contains the value return false
+            if (find(value) >= 0) {
+                return false;
+            }
+
+            if (count + 1 > load_limit() * set_size) {
+                resize();
+            }
+
+            insert(value);
+            return true;
+        }
+
+        bool remove(T value) {
+            int64_t found = find(value);
+
+            if (found < 0) {
+                return false;
+            }
+
+            // Backward shift: pull each following value one slot closer to home until we reach an empty slot or one
+            // already at home
+            size_t index = found;
+            size_t next = (index + 1) & mask;
+
+            while (table[next].distance > 0) {
+                table[index].value = table[next].value;
+                table[index].distance = table[next].distance - 1;
+
+                index = next;
+                next = (next + 1) & mask;
+            }
+
+            table[index].distance = -1;
+            count--;
+
+            return true;
+        }
+
+        bool contains(T value) {
+            return find(value) >= 0;
+        }
+
+        void contains_batch(const T* values, size_t count, bool* found) {
+            for(size_t begin = 0; begin < count; begin += set<T>::batch_size) {
+                int n = std::min(count - begin, (size_t) set<T>::batch_size);
+
+                for(int b = 0; b < n; b++) {
+                    __builtin_prefetch(&table[hash(values[begin + b])]);
+                }
+
+                for(int b = 0; b < n; b++) {
+                    found[begin + b] = find(values[begin + b]) >= 0;
+                }
+            }
+        }
+
+        size_t size() {
+            return count;
+        }
+
+        // Generate random values until we've inserted pop items
+        void populate(size_t pop, T (*random_t)()) {
+            for(size_t i = 0; i < pop; i++) {
+                while(!add(random_t()));
+            }
+        }
+
+        set_stats stats() {
+            set_stats s;
+
+            // Every slot is a bucket that holds zero or one value
+            s.occupancy = std::vector<uint64_t>(2);
+            for(size_t i = 0; i < set_size; i++) {
+                s.occupancy[table[i].distance >= 0]++;
+            }
+
+            s.capacity = set_size;
+            s.load_factor = (double) count / s.capacity;
+
+#ifdef SET_STATS
+            counters.fill(s);
+#endif
+
+            return s;
+        }
+
+        size_t memory_usage() {
+            return sizeof(*this) + set_size * sizeof(entry);
+        }
+
+        void reserve(size_t count) {
+            size_t size = set<T>::buckets_for(count, load_limit(), 1);
+
+            if (size > set_size) {
+                resize(size);
+            }
+        }
+
+        bool grow() {
+            if (set<T>::growth.idle_load <= 0 || count <= set<T>::growth.idle_load * set_size) {
+                return false;
+            }
+
+            resize();
+            return true;
+        }
+
+        size_t buckets() {
+            return set_size;
+        }
+
+        void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) {
+            for(size_t i = begin; i < end && i < set_size; i++) {
+                if (table[i].distance >= 0) {
+                    fn(table[i].value);
+                }
+            }
+        }
+};
+
+#endif
@@ -1,10 +1,15 @@
 #include <vector>
 #include <functional>
 #include <iostream>
+#include <algorithm>
 
 #include "set.h"
 
-template <typename T> class sequential_set: public set<T> {
+// D is the number of tables, and of hash functions. Two is classic cuckoo hashing; three or four tables reach much
+// higher load factors before an insertion has to resize, at the cost of probing more slots per lookup.
+template <typename T, int D = 2> class sequential_set: public set<T> {
+
+    static_assert(D >= 2, "cuckoo hashing needs at least two tables");
 
     // Hashset entry holds both the value and a flag to determine if the entry currently holds a value. By default this flag is false.
     struct entry {
@@ -15,66 +20,96 @@ template <typename T> class sequential_set: public set<T> {
     private:
 
         // Current size of the hashset
-        int set_size;
+        size_t set_size;
+
+        // Values held, so the load can be checked without a scan
+        size_t count;
 
         // The maximum amount of tries we should attempt before resizing the table
         int limit;
 
         // Tables which correspond to their appropriate hash functions
-        entry* table0;
-        entry* table1;
+        entry* tables[D];
+
+#ifdef SET_STATS
+        set_counters counters;
+#endif
 
         // Primary table
-        int hash0(int value) {
-            return value % set_size;
+        size_t hash0(T value) {
+            return (uint64_t) value % set_size;
         }
 
-        // Secondary table, same function plus an offset
-        int hash1(int value) {
-            uint x = value;
-            x = ((x >> 16) ^ x) * 0x45d9f3b;
-            x = ((x >> 16) ^ x) * 0x45d9f3b;
-            x = (x >> 16) ^ x;
-            return x % set_size;
-        }       
+        // Hash function for table k. Table 0 uses the primary hash, the others mix the value with a per-table offset
+        // so their functions are independent of each other.
+        size_t hash(int k, T value) {
+            if (k == 0) {
+                return hash0(value);
+            }
+
+            return set<T>::mix((uint64_t) value + (k - 1) * 0x9e3779b97f4a7c15ull) % set_size;
+        }
+
+        // Slot index of <value> in every table, with the slots prefetched so the probes overlap their cache misses
+        void candidates(T value, size_t* index) {
+            for(int k = 0; k < D; k++) {
+                index[k] = hash(k, value);
+                __builtin_prefetch(&tables[k][index[k]]);
+            }
+        }
+
+        // Load at which a table of D single-value slots still takes insertions reliably: about half full for two
+        // tables, over 90% for three or more
+        static constexpr double practical_load = D == 2 ? 0.5 : 0.9;
 
         void resize() {
-            // Track the old size, double the current
-            int size_old = set_size;
+            resize(set<T>::growth.next(set_size));
+        }
+
+        void resize(size_t size_new) {
+#ifdef SET_STATS
+            uint64_t started = set_counters::now();
+#endif
+
+            // Track the old size, grow the current
+            size_t size_old = set_size;
 
-            set_size = (size_old * 2);
+            set_size = size_new;
+            count = 0;
 
             // Keep track of the old data as we'll need to reinsert it with the "new" hash function
-            entry* table0_old = table0;
-            entry* table1_old = table1;
+            entry* tables_old[D];
 
-            // New tables, default initializes has_value to false
-            table0 = new entry[set_size];
-            table1 = new entry[set_size];
+            for(int k = 0; k < D; k++) {
+                tables_old[k] = tables[k];
 
-            for(int i = 0; i < set_size; i++) {
-                table0[i].has_value = false;
-                table1[i].has_value = false;
+                // New tables, default initializes has_value to false
+                tables[k] = new entry[set_size];
+
+                for(size_t i = 0; i < set_size; i++) {
+                    tables[k][i].has_value = false;
+                }
             }
 
             // Copy over the old entries, but only the ones that had values
-            for(int i = 0; i < size_old; i++) {
-                if (table0_old[i].has_value) {
-                    add(table0_old[i].value);
+            for(int k = 0; k < D; k++) {
+                for(size_t i = 0; i < size_old; i++) {
+                    if (tables_old[k][i].has_value) {
+                        add(tables_old[k][i].value);
+                    }
                 }
 
-                if (table1_old[i].has_value) {
-                    add(table1_old[i].value);
-                }
+                // Delete old tables
+                delete[] tables_old[k];
             }
 
-            // Delete old tables
-            delete[] table0_old;
-            delete[] table1_old;
+#ifdef SET_STATS
+            counters.resize(set_counters::now() - started);
+#endif
         }
 
         // Swap a new entry, return the old one
-        entry swap(entry* table, T value, int index) {
+        entry swap(entry* table, T value, size_t index) {
             entry entry_old = table[index];
 
             table[index].value = value;
@@ -85,22 +120,24 @@ template <typename T> class sequential_set: public set<T> {
 
     public:
 
-        sequential_set(int size, int limit) {
+        sequential_set(size_t size, int limit) {
             this->set_size = size;
             this->limit = limit;
+            this->count = 0;
 
-            table0 = new entry[set_size];
-            table1 = new entry[set_size];
+            for(int k = 0; k < D; k++) {
+                tables[k] = new entry[set_size];
 
-            for(int i = 0; i < set_size; i++) {
-                table0[i].has_value = false;
-                table1[i].has_value = false;
+                for(size_t i = 0; i < set_size; i++) {
+                    tables[k][i].has_value = false;
+                }
             }
         }
 
         ~sequential_set(){
-            delete[] table0;
-            delete[] table1;
+            for(int k = 0; k < D; k++) {
+                delete[] tables[k];
+            }
         }
         
         bool add(T value) {
@@ -108,22 +145,34 @@ template <typename T> class sequential_set: public set<T> {
             if (contains(value)) {
                 return false;
             }
+
+            if (count + 1 > set<T>::growth.max_load * D * set_size) {
+                resize();
+            }
             
-            for(int i = 0; i < limit; i++) {
-                entry swapped = swap(table0, value, hash0(value));
-                if (!swapped.has_value) {
-                    return true;
-                }
-                value = swapped.value;
+            // Number of values we've evicted so far
+            int path = 0;
 
-                // Take the value we swapped from table0 and repeat the process for table1
-                swapped = swap(table1, value, hash1(value));
-                if (!swapped.has_value) {
-                    return true;
+            for(int i = 0; i < limit; i++) {
+                // Place the value in each table in turn, whatever it evicts moves on to the next table
+                for(int k = 0; k < D; k++) {
+                    entry swapped = swap(tables[k], value, hash(k, value));
+                    if (!swapped.has_value) {
+#ifdef SET_STATS
+                        counters.path(path);
+#endif
+                        count++;
+                        return true;
+                    }
+                    value = swapped.value;
+                    path++;
                 }
-                value = swapped.value;
             }
 
+#ifdef SET_STATS
+            counters.path(path);
+#endif
+
             // We've gone <limit> iterations, the table is probably full, resize it
             resize();
             add(value);
@@ -132,56 +181,85 @@ template <typename T> class sequential_set: public set<T> {
         }
 
         bool remove(T value){
-            // Check if the value is in table0, if so, remove it
-            int index = hash0(value);
-
-            if (table0[index].has_value && table0[index].value == value) {
-                table0[index].has_value = false;
-                return true;
+            size_t index[D];
+            candidates(value, index);
+
+            // Check if the value is in any of the tables, if so, remove it
+            for(int k = 0; k < D; k++) {
+                if (tables[k][index[k]].has_value && tables[k][index[k]].value == value) {
+                    tables[k][index[k]].has_value = false;
+                    count--;
+                    return true;
+                }
             }
 
-            // Check if the value is in table1, if so, remove it
-            index = hash1(value);
+            // The value wasn't in any table, return false
+            return false;
+        }
+
+        bool contains(T value){
+            size_t index[D];
+            candidates(value, index);
 
-            if (table1[index].has_value && table1[index].value == value) {
-                table1[index].has_value = false;
-                return true;
+            // Check if the value is in any of the tables
+            for(int k = 0; k < D; k++) {
+                if (tables[k][index[k]].has_value && tables[k][index[k]].value == value) {
+                    return true;
+                }
             }
 
-            // The value wasn't in either table, return false
+            // The value wasn't in any table, return false
             return false;
         }
 
-        bool contains(T value){
-            // Check if the value is in table0
-            int index = hash0(value);
+        void contains_batch(const T* values, size_t count, bool* found) {
+            size_t index[set<T>::batch_size][D];
+
+            for(size_t begin = 0; begin < count; begin += set<T>::batch_size) {
+                int n = std::min(count - begin, (size_t) set<T>::batch_size);
+
+                for(int b = 0; b < n; b++) {
+                    candidates(values[begin + b], index[b]);
+                }
 
-            if (table0[index].has_value && table0[index].value == value) {
-                return true;
+                for(int b = 0; b < n; b++) {
+                    found[begin + b] = false;
+
+                    for(int k = 0; k < D; k++) {
+                        if (tables[k][index[b][k]].has_value && tables[k][index[b][k]].value == values[begin + b]) {
+                            found[begin + b] = true;
+                            break;
+                        }
+                    }
+                }
             }
+        }
 
-            // Check if the value is in table1
-            index = hash1(value);
+        // Adds the values partition by partition, so the primary table is written one cache-sized stretch at a time
+        size_t insert_batch(const T* values, size_t count) {
+            std::vector<T> sorted;
+            std::vector<size_t> bounds;
 
-            if (table1[index].has_value && table1[index].value == value) {
-                return true;
+            size_t span = std::max((size_t) 1, set<T>::chunk_bytes / sizeof(entry));
+            set<T>::partition(values, count, set_size, span, [this](T value) { return hash0(value); }, sorted, bounds);
+
+            size_t added = 0;
+            for(size_t i = 0; i < count; i++) {
+                added += add(sorted[i]);
             }
 
-            // The value wasn't in either table, return false
-            return false;
+            return added;
         }
 
-        int size() {
-            int count = 0;
+        size_t size() {
+            size_t count = 0;
             
-            // Iterate over both tables, add to count whenever we hit an element
-            for(int i = 0; i < set_size; i++) {
-                if (table0[i].has_value) {
-                    count++;
-                }
-
-                if (table1[i].has_value) {
-                    count++;
+            // Iterate over all tables, add to count whenever we hit an element
+            for(int k = 0; k < D; k++) {
+                for(size_t i = 0; i < set_size; i++) {
+                    if (tables[k][i].has_value) {
+                        count++;
+                    }
                 }
             }
 
@@ -189,9 +267,145 @@ template <typename T> class sequential_set: public set<T> {
         }
 
         // Generate random values until we've inserted pop items
-        void populate(int pop, T (*random_t)()) {
-            for(int i = 0; i < pop; i++) {
+        void populate(size_t pop, T (*random_t)()) {
+            for(size_t i = 0; i < pop; i++) {
                 while(!add(random_t()));
             }
         }
+
+        set_stats stats() {
+            set_stats s;
+
+            // Every slot is a bucket that holds zero or one value
+            s.occupancy = std::vector<uint64_t>(2);
+            for(int k = 0; k < D; k++) {
+                for(size_t i = 0; i < set_size; i++) {
+                    s.occupancy[tables[k][i].has_value]++;
+                }
+            }
+
+            s.capacity = D * set_size;
+            s.load_factor = (double) s.occupancy[1] / s.capacity;
+
+#ifdef SET_STATS
+            counters.fill(s);
+#endif
+
+            return s;
+        }
+
+        size_t memory_usage() {
+            return sizeof(*this) + D * set_size * sizeof(entry);
+        }
+
+        void reserve(size_t count) {
+            size_t size = set<T>::buckets_for(count, std::min(set<T>::growth.max_load, practical_load), D);
+
+            if (size > set_size) {
+                resize(size);
+            }
+        }
+
+        bool grow() {
+            if (set<T>::growth.idle_load <= 0 || count <= set<T>::growth.idle_load * D * set_size) {
+                return false;
+            }
+
+            resize();
+            return true;
+        }
+
+        size_t buckets() {
+            return set_size;
+        }
+
+        void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) {
+            for(size_t i = begin; i < end && i < set_size; i++) {
+                for(int k = 0; k < D; k++) {
+                    if (tables[k][i].has_value) {
+                        fn(tables[k][i].value);
+                    }
+                }
+            }
+        }
+
+        // Walks the tables in place, table by table. Like the rest of this set it must not be used while the set is
+        // being modified, and adding or removing through the set invalidates it.
+        class iterator {
+
+            public:
+
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = T;
+                using difference_type = std::ptrdiff_t;
+                using pointer = const T*;
+                using reference = const T&;
+
+            private:
+
+                sequential_set* owner;
+
+                int table;
+                size_t index;
+
+                // Skip forward to the next slot holding a value, or to the end
+                void skip() {
+                    while (table < D && !owner->tables[table][index].has_value) {
+                        if (++index == owner->set_size) {
+                            index = 0;
+                            table++;
+                        }
+                    }
+                }
+
+            public:
+
+                iterator(sequential_set* owner, int table) {
+                    this->owner = owner;
+                    this->table = table;
+                    this->index = 0;
+
+                    skip();
+                }
+
+                const T& operator*() const {
+                    return owner->tables[table][index].value;
+                }
+
+                const T* operator->() const {
+                    return &owner->tables[table][index].value;
+                }
+
+                iterator& operator++() {
+                    if (++index == owner->set_size) {
+                        index = 0;
+                        table++;
+                    }
+
+                    skip();
+                    return *this;
+                }
+
+                iterator operator++(int) {
+                    iterator previous = *this;
+                    ++(*this);
+                    return previous;
+                }
+
+                bool operator==(const iterator& other) const {
+                    return table == other.table && index == other.index;
+                }
+
+                bool operator!=(const iterator& other) const {
+                    return !(*this == other);
+                }
+        };
+
+        iterator begin() {
+            return iterator(this, 0);
+        }
+
+        iterator end() {
+            return iterator(this, D);
+        }
 };
\ No newline at end of file
@@ -1,19 +1,316 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <iterator>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+#include "stats.h"
+
+// When a set grows, and to what size. Every set grows when an insertion finds no room; a policy can also make it grow
+// at a chosen load, in smaller steps than doubling, and ahead of time when the caller has a quiet moment, so memory
+// goes up at predictable points. The defaults keep growth on failure only, doubling each time.
+struct growth_policy {
+
+    // Fraction of the capacity (set_stats::capacity) in use at which an insertion grows the set. 1 never grows early.
+    double max_load = 1.0;
+
+    // Size after growing as a multiple of the size before. Below 2 each step costs less memory, but steps come sooner.
+    double factor = 2.0;
+
+    // Load past which set<T>::grow() grows the set ahead of time, 0 never does
+    double idle_load = 0;
+
+    size_t next(size_t size) const {
+        return std::max(size + 1, (size_t) (size * factor));
+    }
+};
+
 template<typename T> class set {
 
     public:
-        
+
+        // Sets are deleted through this interface, so the implementations' destructors must run
+        virtual ~set() {}
+
         virtual bool add(T value)       = 0;
 
         virtual bool remove(T value)    = 0;
 
         virtual bool contains(T value)  = 0;
 
-        virtual int size()              = 0;
+        // Insert <count> values, returning how many were new. By default they are added one at a time; the cuckoo sets
+        // partition them by primary bucket first, see partition().
+        virtual size_t insert_batch(const T* values, size_t count) {
+            size_t added = 0;
+
+            for (size_t i = 0; i < count; i++) {
+                added += add(values[i]);
+            }
+
+            return added;
+        }
+
+        // Group operations: add or remove every one of <count> values, returning how many were new or present, or swap
+        // <from> for <to> if <from> is present and <to> isn't. The defaults go one value at a time, which is only atomic
+        // for a set nothing else is using; concurrent_set and transactional_set apply the whole group in one step.
+        virtual size_t add_all(const T* values, size_t count) {
+            size_t added = 0;
+
+            for (size_t i = 0; i < count; i++) {
+                added += add(values[i]);
+            }
+
+            return added;
+        }
+
+        virtual size_t remove_all(const T* values, size_t count) {
+            size_t removed = 0;
+
+            for (size_t i = 0; i < count; i++) {
+                removed += remove(values[i]);
+            }
+
+            return removed;
+        }
+
+        virtual bool replace(T from, T to) {
+            if (contains(to) || !remove(from)) {
+                return false;
+            }
+
+            add(to);
+            return true;
+        }
+
+        // Look up <count> values at once, setting found[i] to whether values[i] is in the set. The candidate buckets of
+        // a whole batch are prefetched before any is probed, so the cache misses overlap instead of queueing up, except in
+        // transactional_set, which looks them up one at a time.
+        virtual void contains_batch(const T* values, size_t count, bool* found) = 0;
+
+        virtual size_t size()           = 0;
+
+        virtual void populate(size_t size, T (*random_T)()) = 0;
+
+        // Snapshot of the implementation's internals, see stats.h
+        virtual set_stats stats()       = 0;
+
+        // Bytes the set has allocated for its tables, buckets and locks
+        virtual size_t memory_usage()   = 0;
+
+        // Takes effect from the next insertion, an existing table isn't resized to match
+        virtual void set_growth(const growth_policy& policy) {
+            growth = policy;
+        }
+
+        // Grow now so that <count> values fit without growing again under the current policy. Never shrinks.
+        virtual void reserve(size_t count) = 0;
+
+        // Grow one step if the load is past the policy's idle_load, returning whether it did. Meant to be called while
+        // the set is quiet, so the rebuild doesn't land on an insertion in the middle of the workload.
+        virtual bool grow() {
+            return false;
+        }
+
+        // Number of slots per table. Scans address the set by slot, slot i covering bucket i of every table.
+        virtual size_t buckets()        = 0;
+
+        // Values contains_batch() prefetches ahead of probing, larger batches are handled in steps of this many
+        static constexpr int batch_size = 16;
+
+        // Bytes of primary table a partition of insert_batch() covers, about what stays resident in a core's L2
+        static constexpr size_t chunk_bytes = 256 * 1024;
+
+        // Call <fn> on every value in slots [begin, end). The concurrent sets copy each slot out under its locks and
+        // call <fn> with no locks held, so writers are only ever kept out of the slot being copied. That makes the scan
+        // weakly consistent: a value present and left in place for the whole scan is visited exactly once, one added,
+        // removed or relocated meanwhile may or may not be, and a resize part way through can skip or repeat values.
+        virtual void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) = 0;
+
+        void for_each(const std::function<void(T)>& fn) {
+            for_each_range(0, buckets(), fn);
+        }
+
+        // Split the slots into <threads> contiguous ranges and scan them in parallel. <fn> is called concurrently from
+        // the workers and must be safe to call that way.
+        void parallel_for_each(const std::function<void(T)>& fn, int threads) {
+            size_t slots = buckets();
+            std::vector<std::thread> workers;
+
+            for (int t = 0; t < threads; t++) {
+                size_t begin = slots * t / threads;
+                size_t end = slots * (t + 1) / threads;
+
+                workers.push_back(std::thread([this, &fn, begin, end]() {
+                    for_each_range(begin, end, fn);
+                }));
+            }
+
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        // Copy the contents into a flat vector, with the same consistency as for_each_range()
+        std::vector<T> snapshot(int threads = 1) {
+            std::vector<std::vector<T>> parts(threads);
+
+            size_t slots = buckets();
+            std::vector<std::thread> workers;
+
+            for (int t = 0; t < threads; t++) {
+                size_t begin = slots * t / threads;
+                size_t end = slots * (t + 1) / threads;
+
+                workers.push_back(std::thread([this, &parts, t, begin, end]() {
+                    for_each_range(begin, end, [&parts, t](T value) {
+                        parts[t].push_back(value);
+                    });
+                }));
+            }
+
+            std::vector<T> values;
+            for (int t = 0; t < threads; t++) {
+                workers[t].join();
+                values.insert(values.end(), parts[t].begin(), parts[t].end());
+            }
+
+            return values;
+        }
+
+        // Forward iterator that copies out one slot at a time through for_each_range(), so it is safe to use while
+        // other threads modify the set and has the same weak consistency.
+        class iterator {
+
+            public:
+
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = T;
+                using difference_type = std::ptrdiff_t;
+                using pointer = const T*;
+                using reference = const T&;
+
+            private:
+
+                set* owner;
+
+                // Slot the buffered values were copied from, and the position in the buffer
+                size_t slot;
+                size_t position;
+
+                std::vector<T> buffer;
+
+                // Move on to the next slot holding any values, or to the end
+                void fill() {
+                    while (position >= buffer.size() && owner) {
+                        buffer.clear();
+                        position = 0;
+
+                        if (++slot >= owner->buckets()) {
+                            owner = NULL;
+                            slot = SIZE_MAX;
+                            break;
+                        }
+
+                        owner->for_each_range(slot, slot + 1, [this](T value) {
+                            buffer.push_back(value);
+                        });
+                    }
+                }
+
+            public:
+
+                iterator(set* owner) {
+                    this->owner = owner;
+                    this->slot = SIZE_MAX;
+                    this->position = 0;
+
+                    fill();
+                }
+
+                const T& operator*() const {
+                    return buffer[position];
+                }
+
+                const T* operator->() const {
+                    return &buffer[position];
+                }
+
+                iterator& operator++() {
+                    position++;
+                    fill();
+                    return *this;
+                }
+
+                iterator operator++(int) {
+                    iterator previous = *this;
+                    ++(*this);
+                    return previous;
+                }
+
+                bool operator==(const iterator& other) const {
+                    return owner == other.owner && slot == other.slot && position == other.position;
+                }
+
+                bool operator!=(const iterator& other) const {
+                    return !(*this == other);
+                }
+        };
+
+        iterator begin() {
+            return iterator(this);
+        }
+
+        iterator end() {
+            return iterator(NULL);
+        }
+
+    protected:
+
+        growth_policy growth;
+
+        // Buckets of <slots> values each that hold <count> values at <load>
+        static size_t buckets_for(size_t count, double load, size_t slots) {
+            return std::max((size_t) 1, (size_t) std::ceil(count / (load * slots)));
+        }
+
+        // 64-bit finalizer (splitmix64) for the hash functions. Every bit of the key reaches every bit of the result,
+        // so keys wider than 32 bits don't collide on their low half and indices beyond 2^32 slots are reachable.
+        static uint64_t mix(uint64_t x) {
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+            return x ^ (x >> 31);
+        }
+
+        // Radix-partition <values> by primary bucket into runs that each cover <span> consecutive buckets, so inserting
+        // a run only touches a cache-sized stretch of the primary table. Run r is [bounds[r], bounds[r + 1]) of <out>.
+        template <typename Bucket>
+        static void partition(const T* values, size_t count, size_t buckets, size_t span, Bucket bucket_of, std::vector<T>& out, std::vector<size_t>& bounds) {
+            size_t runs = (buckets + span - 1) / span;
+            std::vector<size_t> run_of(count);
+
+            // Count each run's values, then turn the counts into starting offsets
+            bounds.assign(runs + 1, 0);
+            for (size_t i = 0; i < count; i++) {
+                run_of[i] = bucket_of(values[i]) / span;
+                bounds[run_of[i] + 1]++;
+            }
+
+            for (size_t r = 0; r < runs; r++) {
+                bounds[r + 1] += bounds[r];
+            }
+
+            std::vector<size_t> next(bounds.begin(), bounds.end() - 1);
+            out.resize(count);
 
-        virtual void populate(int size, T (*random_T)()) = 0;
+            for (size_t i = 0; i < count; i++) {
+                out[next[run_of[i]]++] = values[i];
+            }
+        }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,650 @@
+#ifndef SHARED_CPP
+#define SHARED_CPP
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "set.h"
+
+// Start of a shared set's segment. Everything after it is found through offsets from the start of the mapping, so the
+// segment can sit at a different address in every process that attaches it.
+struct shared_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t tables;
+
+    uint64_t size;
+    int32_t locks;
+    int32_t limit;
+    int32_t probe_size;
+    int32_t threshold;
+
+    // Bytes per value, a set of another value type can't attach
+    uint32_t value_size;
+    int32_t padding;
+
+    uint64_t length;
+
+    // Offsets of the stripe locks (D x locks), the per-bucket value counts (D x size) and the bucket slots
+    // (D x size x probe_size), each region 64-byte aligned
+    uint64_t locks_offset;
+    uint64_t counts_offset;
+    uint64_t values_offset;
+
+    // Set once the creator has initialised the segment, attachers wait for it
+    std::atomic<uint32_t> ready;
+
+    // Values held, and insertions turned away because their buckets stayed full after relocating
+    std::atomic<int64_t> count;
+    std::atomic<uint64_t> rejected;
+};
+
+static const char shared_magic[8] = {'H', 'S', 'S', 'H', 'A', 'R', 'E', '\0'};
+static const uint32_t shared_version = 2;
+
+// Bucketed cuckoo set whose tables, stripe locks and counters live in a POSIX shared-memory segment, so any number of
+// processes on the host can attach to one copy and operate on it concurrently. The locks are process-shared robust
+// mutexes: a process that dies holding one doesn't wedge the others. Remapping every attached process isn't
+// practical, so the capacity is fixed when the segment is created and an insertion that finds no room after
+// relocating is rejected (add returns false and the rejection is counted) instead of resizing.
+template <typename T, int D = 2> class shared_set: public set<T> {
+
+    static_assert(D >= 2, "cuckoo hashing needs at least two tables");
+    static_assert(std::is_trivially_copyable<T>::value, "shared values are copied between processes as raw bytes");
+    static_assert(std::atomic<int64_t>::is_always_lock_free, "shared counters must be lock-free to be process-shared");
+
+    // The stripe locks covering a value's bucket in every table, released in reverse order
+    struct guard {
+        pthread_mutex_t* locks[D];
+        int held;
+
+        guard() {
+            held = 0;
+        }
+
+        ~guard() {
+            release();
+        }
+
+        void release() {
+            while (held > 0) {
+                pthread_mutex_unlock(locks[--held]);
+            }
+        }
+    };
+
+    private:
+
+        int fd;
+        void* base;
+        size_t length;
+
+        // Whether this process created the segment, only the creator populates it
+        bool creator;
+
+        shared_header* header;
+
+        // This process's view of the segment's regions
+        pthread_mutex_t* stripes;
+        int32_t* counts[D];
+        T* values[D];
+
+        // Copied out of the header, they never change once the segment exists
+        size_t set_size;
+        int locks;
+        int limit;
+        int probe_size;
+        int threshold;
+
+#ifdef SET_STATS
+        // Event counters are kept per process, sized once we know the number of stripes
+        std::unique_ptr<set_counters> counters;
+#endif
+
+        static uint64_t align(uint64_t offset) {
+            return (offset + 63) & ~(uint64_t) 63;
+        }
+
+        size_t hash0(T value) {
+            return (uint64_t) value % set_size;
+        }
+
+        // Hash function for table k, table 0 uses the primary hash and the others a per-table mix
+        size_t hash(int k, T value) {
+            if (k == 0) {
+                return hash0(value);
+            }
+
+            return set<T>::mix((uint64_t) value + (k - 1) * 0x9e3779b97f4a7c15ull) % set_size;
+        }
+
+        T* bucket(int k, size_t index) {
+            return values[k] + index * probe_size;
+        }
+
+        // EOWNERDEAD means the previous owner died holding the lock. The set stays usable, but whatever it was doing is
+        // left half done: an insert or remove can leave a count out of step with its bucket, and a relocation that
+        // died between taking a value out of one bucket and pushing it into the other has lost that value. Neither is
+        // repaired, the lock is just marked consistent again.
+        void lock(pthread_mutex_t* mutex) {
+#ifdef SET_STATS
+            int stripe = mutex - stripes;
+            int result = pthread_mutex_trylock(mutex);
+
+            if (result == 0 || result == EOWNERDEAD) {
+                if (result == EOWNERDEAD) {
+                    pthread_mutex_consistent(mutex);
+                }
+
+                counters->lock(stripe, false, 0);
+                return;
+            }
+
+            uint64_t started = set_counters::now();
+#endif
+            if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+                pthread_mutex_consistent(mutex);
+            }
+#ifdef SET_STATS
+            counters->lock(stripe, true, set_counters::now() - started);
+#endif
+        }
+
+        void acquire(guard& held, T value) {
+            for(int k = 0; k < D; k++) {
+                int stripe = k * locks + hash(k, value) % locks;
+                lock(&stripes[stripe]);
+                held.locks[held.held++] = &stripes[stripe];
+            }
+        }
+
+        // Position of <value> in bucket <index> of table <k>, or -1. Callers hold the bucket's stripe.
+        int find(int k, size_t index, T value) {
+            T* slots = bucket(k, index);
+
+            for(int s = 0; s < counts[k][index]; s++) {
+                if (slots[s] == value) {
+                    return s;
+                }
+            }
+
+            return -1;
+        }
+
+        void push(int k, size_t index, T value) {
+            bucket(k, index)[counts[k][index]] = value;
+            counts[k][index]++;
+        }
+
+        // Remove the value at position <s>, moving the bucket's last value into its place
+        void erase(int k, size_t index, int s) {
+            T* slots = bucket(k, index);
+
+            slots[s] = slots[counts[k][index] - 1];
+            counts[k][index]--;
+        }
+
+        // Move values out of bucket <hi> of table <i> into their least loaded alternate buckets until every bucket on
+        // the path is back under the threshold. Returns false if that fails within <limit> rounds.
+        bool relocate(int i, size_t hi) {
+            int path = 0;
+            int round = 0;
+
+            for (; round < limit; round++) {
+                // Peek at the oldest value in the bucket under the bucket's own stripe, then lock all of its stripes
+                T val;
+                {
+                    int stripe = i * locks + hi % locks;
+                    lock(&stripes[stripe]);
+
+                    bool empty = counts[i][hi] == 0;
+                    if (!empty) {
+                        val = bucket(i, hi)[0];
+                    }
+
+                    pthread_mutex_unlock(&stripes[stripe]);
+
+                    if (empty) {
+                        break;
+                    }
+                }
+
+                guard held;
+                acquire(held, val);
+
+                int s = find(i, hi, val);
+
+                if (s < 0) {
+                    if (counts[i][hi] >= threshold) {
+                        continue;
+                    }
+                    break;
+                }
+
+                int j = -1;
+                size_t hj = 0;
+                for(int k = 0; k < D; k++) {
+                    if (k != i && (j < 0 || counts[k][hash(k, val)] < counts[j][hj])) {
+                        j = k;
+                        hj = hash(k, val);
+                    }
+                }
+
+                if (counts[j][hj] >= probe_size) {
+#ifdef SET_STATS
+                    counters->path(path);
+#endif
+                    return false;
+                }
+
+                erase(i, hi, s);
+                push(j, hj, val);
+                path++;
+
+                if (counts[j][hj] <= threshold) {
+#ifdef SET_STATS
+                    counters->path(path);
+#endif
+                    return true;
+                }
+
+                i = j;
+                hi = hj;
+            }
+
+#ifdef SET_STATS
+            counters->path(path);
+#endif
+
+            // We only run out of rounds if the path never ended
+            return round < limit;
+        }
+
+        // Point this process's view at the regions the header describes
+        void map_regions() {
+            header = (shared_header*) base;
+
+            set_size = header->size;
+            locks = header->locks;
+            limit = header->limit;
+            probe_size = header->probe_size;
+            threshold = header->threshold;
+
+            stripes = (pthread_mutex_t*) ((char*) base + header->locks_offset);
+
+            for(int k = 0; k < D; k++) {
+                counts[k] = (int32_t*) ((char*) base + header->counts_offset) + k * set_size;
+                values[k] = (T*) ((char*) base + header->values_offset) + k * set_size * probe_size;
+            }
+        }
+
+    public:
+
+        shared_set() {
+            fd = -1;
+            base = MAP_FAILED;
+            length = 0;
+            creator = false;
+            header = NULL;
+        }
+
+        ~shared_set() {
+            detach();
+        }
+
+        // Create the segment <name> with room for <size> buckets of <probe_size> values per table. Fails if the
+        // segment already exists. Returns false with a reason in <error>.
+        bool create(const std::string& name, size_t size, int num_locks, int limit, int probe_size, int threshold, std::string& error) {
+            detach();
+
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0) {
+                error = "can't create shared segment " + name + ": " + strerror(errno);
+                return false;
+            }
+
+            uint64_t locks_offset = align(sizeof(shared_header));
+            uint64_t counts_offset = align(locks_offset + (uint64_t) D * num_locks * sizeof(pthread_mutex_t));
+            uint64_t values_offset = align(counts_offset + (uint64_t) D * size * sizeof(int32_t));
+
+            length = align(values_offset + (uint64_t) D * size * probe_size * sizeof(T));
+
+            // A fresh segment reads as zeroes, which is every bucket empty
+            if (ftruncate(fd, length) != 0) {
+                error = "can't size shared segment " + name + ": " + strerror(errno);
+                return false;
+            }
+
+            base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED) {
+                error = "can't map shared segment " + name;
+                return false;
+            }
+
+            header = (shared_header*) base;
+            memcpy(header->magic, shared_magic, sizeof(header->magic));
+            header->version = shared_version;
+            header->tables = D;
+            header->size = size;
+            header->value_size = sizeof(T);
+            header->locks = num_locks;
+            header->limit = limit;
+            header->probe_size = probe_size;
+            header->threshold = threshold;
+            header->length = length;
+            header->locks_offset = locks_offset;
+            header->counts_offset = counts_offset;
+            header->values_offset = values_offset;
+            header->count = 0;
+            header->rejected = 0;
+
+            map_regions();
+
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+            for(int i = 0; i < D * num_locks; i++) {
+                pthread_mutex_init(&stripes[i], &attr);
+            }
+
+            pthread_mutexattr_destroy(&attr);
+
+#ifdef SET_STATS
+            counters.reset(new set_counters(D * num_locks));
+#endif
+
+            creator = true;
+            header->ready.store(1, std::memory_order_release);
+
+            return true;
+        }
+
+        // Attach to a segment another process created, waiting up to <timeout> seconds for it to be initialised.
+        // Returns false with a reason in <error>.
+        bool attach(const std::string& name, std::string& error, double timeout = 10) {
+            detach();
+
+            fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd < 0) {
+                error = "can't open shared segment " + name + ": " + strerror(errno);
+                return false;
+            }
+
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+
+            // The creator sizes the segment before it fills in the header
+            struct stat info;
+            while (fstat(fd, &info) == 0 && (size_t) info.st_size < sizeof(shared_header)) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    error = "shared segment " + name + " was never initialised";
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            length = info.st_size;
+            base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED) {
+                error = "can't map shared segment " + name;
+                return false;
+            }
+
+            header = (shared_header*) base;
+            while (!header->ready.load(std::memory_order_acquire)) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    error = "shared segment " + name + " was never initialised";
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            if (memcmp(header->magic, shared_magic, sizeof(shared_magic)) != 0 || header->version != shared_version) {
+                error = name + " is not a version " + std::to_string(shared_version) + " shared set";
+                return false;
+            }
+
+            if (header->tables != D) {
+                error = name + " was created with " + std::to_string(header->tables) + " tables, not " + std::to_string(D);
+                return false;
+            }
+
+            if (header->length != length) {
+                error = name + " is " + std::to_string(length) + " bytes long, not " + std::to_string(header->length);
+                return false;
+            }
+
+            if (header->value_size != sizeof(T)) {
+                error = name + " holds " + std::to_string(header->value_size) + "-byte values, not " + std::to_string(sizeof(T));
+                return false;
+            }
+
+            map_regions();
+
+#ifdef SET_STATS
+            counters.reset(new set_counters(D * locks));
+#endif
+
+            creator = false;
+            return true;
+        }
+
+        // Unmap the segment from this process. The segment itself lives on until it is unlinked.
+        void detach() {
+            if (base != MAP_FAILED) {
+                munmap(base, length);
+                base = MAP_FAILED;
+            }
+
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+
+            header = NULL;
+        }
+
+        // Remove the segment's name. Processes that have it mapped keep using it, the memory goes with the last one.
+        static bool unlink(const std::string& name) {
+            return shm_unlink(name.c_str()) == 0;
+        }
+
+        bool created() {
+            return creator;
+        }
+
+        bool add(T value) {
+            // A second attempt after relocating values out of the way of a full set of buckets
+            for(int attempt = 0; attempt < 2; attempt++) {
+                guard held;
+                acquire(held, value);
+
+                size_t index[D];
+                for(int k = 0; k < D; k++) {
+                    index[k] = hash(k, value);
+
+                    // If the table already contains the value return false
+                    if (find(k, index[k], value) >= 0) {
+                        return false;
+                    }
+                }
+
+                // Any bucket under the threshold takes the value outright
+                for(int k = 0; k < D; k++) {
+                    if (counts[k][index[k]] < threshold) {
+                        push(k, index[k], value);
+                        header->count++;
+#ifdef SET_STATS
+                        counters->path(0);
+#endif
+                        return true;
+                    }
+                }
+
+                // Otherwise the first with room takes it and gets relocated back under the threshold
+                for(int k = 0; k < D; k++) {
+                    if (counts[k][index[k]] < probe_size) {
+                        push(k, index[k], value);
+                        header->count++;
+
+                        held.release();
+                        relocate(k, index[k]);
+                        return true;
+                    }
+                }
+
+                held.release();
+                relocate(0, index[0]);
+            }
+
+            header->rejected++;
+            return false;
+        }
+
+        bool remove(T value) {
+            guard held;
+            acquire(held, value);
+
+            for(int k = 0; k < D; k++) {
+                size_t index = hash(k, value);
+                int s = find(k, index, value);
+
+                if (s >= 0) {
+                    erase(k, index, s);
+                    header->count--;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        bool contains(T value) {
+            guard held;
+            acquire(held, value);
+
+            for(int k = 0; k < D; k++) {
+                if (find(k, hash(k, value), value) >= 0) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // The tables never move, so the batch's buckets can be prefetched before taking any locks
+        void contains_batch(const T* values, size_t count, bool* found) {
+            for(size_t begin = 0; begin < count; begin += set<T>::batch_size) {
+                int n = std::min(count - begin, (size_t) set<T>::batch_size);
+
+                for(int b = 0; b < n; b++) {
+                    for(int k = 0; k < D; k++) {
+                        size_t index = hash(k, values[begin + b]);
+                        __builtin_prefetch(&counts[k][index]);
+                        __builtin_prefetch(bucket(k, index));
+                    }
+                }
+
+                for(int b = 0; b < n; b++) {
+                    found[begin + b] = contains(values[begin + b]);
+                }
+            }
+        }
+
+        size_t size() {
+            return header->count;
+        }
+
+        // Only the process that created the segment fills it, attached processes share what is already there
+        void populate(size_t pop, T (*random_t)()) {
+            if (!creator) {
+                return;
+            }
+
+            // Stop early rather than spin once the fixed capacity turns values away
+            uint64_t rejected = header->rejected;
+
+            for(size_t i = 0; i < pop && header->rejected == rejected; i++) {
+                while(!add(random_t()) && header->rejected == rejected);
+            }
+        }
+
+        set_stats stats() {
+            set_stats s;
+            size_t count = 0;
+
+            s.occupancy = std::vector<uint64_t>(probe_size + 1);
+            for(int k = 0; k < D; k++) {
+                for(size_t i = 0; i < set_size; i++) {
+                    s.occupancy[counts[k][i]]++;
+                    count += counts[k][i];
+                }
+            }
+
+            s.capacity = D * set_size * probe_size;
+            s.load_factor = (double) count / s.capacity;
+            s.rejected = header->rejected;
+
+#ifdef SET_STATS
+            counters->fill(s);
+#endif
+
+            return s;
+        }
+
+        // The whole segment, which every attached process shares
+        size_t memory_usage() {
+            return length;
+        }
+
+        // The capacity is fixed when the segment is created, so there is nothing to grow
+        void reserve(size_t) {
+        }
+
+        size_t buckets() {
+            return set_size;
+        }
+
+        void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) {
+            std::vector<T> slot;
+
+            for(size_t i = begin; i < end && i < set_size; i++) {
+                slot.clear();
+
+                {
+                    guard held;
+                    for(int k = 0; k < D; k++) {
+                        int stripe = k * locks + i % locks;
+                        lock(&stripes[stripe]);
+                        held.locks[held.held++] = &stripes[stripe];
+                    }
+
+                    for(int k = 0; k < D; k++) {
+                        slot.insert(slot.end(), bucket(k, i), bucket(k, i) + counts[k][i]);
+                    }
+                }
+
+                for (T value : slot) {
+                    fn(value);
+                }
+            }
+        }
+};
+
+#endif
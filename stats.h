@@ -0,0 +1,196 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Snapshot of a set's internals, returned by set<T>::stats(). The structural fields (capacity, load factor, occupancy)
+// are computed on demand and always filled in. The event counters are only maintained in builds with -DSET_STATS
+// (make STATS=1) so the default build pays nothing for them.
+struct set_stats {
+
+    // Whether the event counters below were maintained
+    bool counters_enabled = false;
+
+    // Slots across all tables, and the fraction of them holding a value
+    size_t capacity = 0;
+    double load_factor = 0;
+
+    // occupancy[k] is the number of buckets holding exactly k values
+    std::vector<uint64_t> occupancy;
+
+    // Insertions a fixed-capacity set had no room for
+    uint64_t rejected = 0;
+
+    // Displacement path lengths of insertions, bucketed by powers of two: 0, 1, 2-3, 4-7, ...
+    std::vector<uint64_t> path_lengths;
+    uint64_t displacements = 0;
+
+    uint64_t resizes = 0;
+    uint64_t resize_ns = 0;
+
+    // Stripe lock acquisitions, how many found the stripe already held, and the time spent waiting for those
+    uint64_t lock_acquisitions = 0;
+    uint64_t lock_contended = 0;
+    uint64_t lock_wait_ns = 0;
+
+    // Contended acquisitions per stripe, the stripes of table 0 followed by those of table 1 and so on
+    std::vector<uint64_t> stripe_contended;
+
+    // Transaction bodies started and committed, the difference is the number of aborted attempts
+    uint64_t tx_attempts = 0;
+    uint64_t tx_commits = 0;
+};
+
+// Event counters the implementations bump while running. The methods are transaction_pure so they can be called from
+// inside __transaction_atomic blocks; increments made by an attempt that later aborts are kept, which is what lets
+// the transactional set count its retries. Commits are counted outside the block instead, see committed.
+class set_counters {
+
+    static const int path_buckets = 16;
+
+    private:
+
+        std::atomic<uint64_t> path_lengths[path_buckets];
+        std::atomic<uint64_t> displacements;
+
+        std::atomic<uint64_t> resizes;
+        std::atomic<uint64_t> resize_ns;
+
+        std::atomic<uint64_t> lock_acquisitions;
+        std::atomic<uint64_t> lock_contended;
+        std::atomic<uint64_t> lock_wait_ns;
+
+        std::vector<std::atomic<uint64_t>> stripe_contended;
+
+        std::atomic<uint64_t> tx_attempts;
+        std::atomic<uint64_t> tx_commits;
+
+    public:
+
+        set_counters(int stripes = 0) : stripe_contended(stripes) {
+            for (int i = 0; i < path_buckets; i++) {
+                path_lengths[i] = 0;
+            }
+
+            displacements = 0;
+            resizes = 0;
+            resize_ns = 0;
+            lock_acquisitions = 0;
+            lock_contended = 0;
+            lock_wait_ns = 0;
+            tx_attempts = 0;
+            tx_commits = 0;
+
+            for (auto& stripe : stripe_contended) {
+                stripe = 0;
+            }
+        }
+
+        __attribute__ ((transaction_pure))
+        static uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        __attribute__ ((transaction_pure))
+        void path(int length) {
+            int bucket = 0;
+            while (bucket < path_buckets - 1 && (1 << bucket) <= length) {
+                bucket++;
+            }
+
+            path_lengths[bucket].fetch_add(1, std::memory_order_relaxed);
+            displacements.fetch_add(length, std::memory_order_relaxed);
+        }
+
+        __attribute__ ((transaction_pure))
+        void resize(uint64_t ns) {
+            resizes.fetch_add(1, std::memory_order_relaxed);
+            resize_ns.fetch_add(ns, std::memory_order_relaxed);
+        }
+
+        void lock(int stripe, bool contended, uint64_t wait_ns) {
+            lock_acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+            if (contended) {
+                lock_contended.fetch_add(1, std::memory_order_relaxed);
+                lock_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+                stripe_contended[stripe].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        __attribute__ ((transaction_pure))
+        void attempt() {
+            tx_attempts.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void commit() {
+            tx_commits.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Declared just before a __transaction_atomic block, it counts the commit as it goes out of scope. That is
+        // after the transaction has committed, however the body left it, and once however many times it restarted.
+        // Counting inside the body can't work: the sets' bodies are transaction_pure, so an increment there is never
+        // rolled back and every attempt would look committed.
+        //
+        // Only the outermost one counts. A nested block is flattened into the enclosing transaction, so its scope can
+        // end while the outer transaction still aborts, and an abort restarts the outer body without running the
+        // nested destructors. Bodies count their attempts through attempt() here for the same reason.
+        struct committed {
+            set_counters& counters;
+            bool outermost;
+
+            committed(set_counters& counters) : counters(counters), outermost(active() == NULL) {
+                if (outermost) {
+                    active() = this;
+                }
+            }
+
+            ~committed() {
+                if (outermost) {
+                    active() = NULL;
+                    counters.commit();
+                }
+            }
+
+            __attribute__ ((transaction_pure))
+            void attempt() {
+                if (outermost) {
+                    counters.attempt();
+                }
+            }
+
+            static committed*& active() {
+                thread_local committed* outer = NULL;
+                return outer;
+            }
+        };
+
+        void fill(set_stats& s) {
+            s.counters_enabled = true;
+
+            s.path_lengths.clear();
+            for (int i = 0; i < path_buckets; i++) {
+                s.path_lengths.push_back(path_lengths[i]);
+            }
+
+            s.displacements = displacements;
+            s.resizes = resizes;
+            s.resize_ns = resize_ns;
+            s.lock_acquisitions = lock_acquisitions;
+            s.lock_contended = lock_contended;
+            s.lock_wait_ns = lock_wait_ns;
+
+            s.stripe_contended.clear();
+            for (auto& stripe : stripe_contended) {
+                s.stripe_contended.push_back(stripe);
+            }
+
+            s.tx_attempts = tx_attempts;
+            s.tx_commits = tx_commits;
+        }
+};
+
+#endif
@@ -0,0 +1,314 @@
+#ifndef TOPOLOGY_CPP
+#define TOPOLOGY_CPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+enum affinity_t {
+    no_affinity = 0,
+    compact_affinity = 1,
+    scatter_affinity = 2,
+    list_affinity = 3
+};
+
+enum memory_t {
+    first_touch_memory = 0,
+    interleaved_memory = 1,
+    local_memory = 2,
+    replicated_memory = 3
+};
+
+// Machine layout as reported by sysfs, used to place benchmark threads and their memory
+class topology {
+
+    // Memory policy modes from <linux/mempolicy.h>, spelled out so we don't need libnuma to build
+    static const int mpol_default = 0;
+    static const int mpol_preferred = 1;
+    static const int mpol_interleave = 3;
+
+    struct cpu {
+        int id;
+        int node;
+        int package;
+        int core;
+    };
+
+    private:
+
+        std::vector<cpu> cpus;
+
+        int node_count;
+
+        static int read_int(const std::string& path, int fallback) {
+            std::ifstream in(path);
+            int value;
+
+            if (in >> value) {
+                return value;
+            }
+
+            return fallback;
+        }
+
+        static std::string read_line(const std::string& path) {
+            std::ifstream in(path);
+            std::string line;
+
+            std::getline(in, line);
+            return line;
+        }
+
+        static int count_distinct(std::vector<int> values) {
+            std::sort(values.begin(), values.end());
+            return std::unique(values.begin(), values.end()) - values.begin();
+        }
+
+    public:
+
+        topology() {
+            node_count = 1;
+
+            std::vector<int> online = parse_list(read_line("/sys/devices/system/cpu/online"));
+            if (online.empty()) {
+                for (int i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); i++) {
+                    online.push_back(i);
+                }
+            }
+
+            for (int id : online) {
+                std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+
+                cpu c;
+                c.id = id;
+                c.node = 0;
+                c.package = read_int(base + "physical_package_id", 0);
+                c.core = read_int(base + "core_id", id);
+
+                cpus.push_back(c);
+            }
+
+            // A cpu belongs to the node whose cpulist names it
+            std::vector<int> nodes = parse_list(read_line("/sys/devices/system/node/online"));
+            for (int node : nodes) {
+                std::vector<int> members = parse_list(read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+
+                for (cpu& c : cpus) {
+                    if (std::find(members.begin(), members.end(), c.id) != members.end()) {
+                        c.node = node;
+                    }
+                }
+            }
+
+            if (!nodes.empty()) {
+                node_count = *std::max_element(nodes.begin(), nodes.end()) + 1;
+            }
+        }
+
+        // Parse a cpu or node list such as "0-3,8,10-11"
+        static std::vector<int> parse_list(const std::string& list) {
+            std::vector<int> ids;
+            std::stringstream stream(list);
+            std::string range;
+
+            while (std::getline(stream, range, ',')) {
+                if (range.empty()) {
+                    continue;
+                }
+
+                size_t dash = range.find('-');
+                int first = atoi(range.substr(0, dash).c_str());
+                int last = dash == std::string::npos ? first : atoi(range.substr(dash + 1).c_str());
+
+                for (int id = first; id <= last; id++) {
+                    ids.push_back(id);
+                }
+            }
+
+            return ids;
+        }
+
+        // Cpu for each of <threads> workers. Compact fills one package core by core before moving on, scatter deals
+        // threads round-robin across packages, list cycles through an explicit set of cpus.
+        std::vector<int> placement(affinity_t policy, int threads, const std::vector<int>& list) {
+            std::vector<int> assigned;
+
+            if (policy == no_affinity) {
+                return assigned;
+            }
+
+            std::vector<cpu> order = cpus;
+            std::sort(order.begin(), order.end(), [](const cpu& a, const cpu& b) {
+                if (a.package != b.package) return a.package < b.package;
+                if (a.core != b.core) return a.core < b.core;
+                return a.id < b.id;
+            });
+
+            if (policy == list_affinity) {
+                for (int t = 0; t < threads && !list.empty(); t++) {
+                    assigned.push_back(list[t % list.size()]);
+                }
+            }
+            else if (policy == compact_affinity) {
+                for (int t = 0; t < threads; t++) {
+                    assigned.push_back(order[t % order.size()].id);
+                }
+            }
+            else {
+                // Group the ordered cpus by package, then take one from each package in turn
+                std::vector<std::vector<int>> by_package;
+                for (size_t i = 0; i < order.size(); i++) {
+                    if (i == 0 || order[i].package != order[i - 1].package) {
+                        by_package.push_back(std::vector<int>());
+                    }
+                    by_package.back().push_back(order[i].id);
+                }
+
+                std::vector<int> dealt;
+                for (size_t round = 0; dealt.size() < order.size(); round++) {
+                    for (auto& package : by_package) {
+                        if (round < package.size()) {
+                            dealt.push_back(package[round]);
+                        }
+                    }
+                }
+
+                for (int t = 0; t < threads; t++) {
+                    assigned.push_back(dealt[t % dealt.size()]);
+                }
+            }
+
+            return assigned;
+        }
+
+        int node_of(int id) {
+            for (cpu& c : cpus) {
+                if (c.id == id) {
+                    return c.node;
+                }
+            }
+
+            return 0;
+        }
+
+        int nodes() {
+            return node_count;
+        }
+
+        int packages() {
+            std::vector<int> ids;
+            for (cpu& c : cpus) {
+                ids.push_back(c.package);
+            }
+            return count_distinct(ids);
+        }
+
+        int cores() {
+            std::vector<int> ids;
+            for (cpu& c : cpus) {
+                ids.push_back(c.package * 65536 + c.core);
+            }
+            return count_distinct(ids);
+        }
+
+        int cpu_count() {
+            return cpus.size();
+        }
+
+        // Whether <id> is an online cpu that a thread can be pinned to
+        bool online(int id) {
+            if (id < 0 || id >= CPU_SETSIZE) {
+                return false;
+            }
+
+            for (cpu& c : cpus) {
+                if (c.id == id) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        static bool pin(pthread_t thread, int id) {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            CPU_SET(id, &mask);
+
+            return pthread_setaffinity_np(thread, sizeof(mask), &mask) == 0;
+        }
+
+        // Start <fn> on a new thread that is confined to cpu <id> before it runs, so its stack and whatever it touches
+        // first are placed from that cpu rather than from wherever the scheduler happened to start it. A negative id
+        // leaves it unpinned. The thread is joined with pthread_join.
+        static bool start(pthread_t& thread, int id, std::function<void()> fn) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+
+            if (id >= 0) {
+                cpu_set_t mask;
+                CPU_ZERO(&mask);
+                CPU_SET(id, &mask);
+
+                if (pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask) != 0) {
+                    pthread_attr_destroy(&attr);
+                    return false;
+                }
+            }
+
+            std::function<void()>* body = new std::function<void()>(std::move(fn));
+            int result = pthread_create(&thread, &attr, [](void* arg) -> void* {
+                std::function<void()>* body = (std::function<void()>*) arg;
+                (*body)();
+                delete body;
+                return NULL;
+            }, body);
+
+            pthread_attr_destroy(&attr);
+
+            if (result != 0) {
+                delete body;
+                return false;
+            }
+
+            return true;
+        }
+
+        static cpu_set_t affinity() {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            pthread_getaffinity_np(pthread_self(), sizeof(mask), &mask);
+
+            return mask;
+        }
+
+        static void restore(cpu_set_t mask) {
+            pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+        }
+
+        // Set the memory policy of the calling thread for allocations it touches from now on. Returns false when the
+        // kernel has no NUMA support, in which case allocation silently stays first-touch.
+        bool interleave() {
+            unsigned long mask = node_count >= 64 ? ~0UL : (1UL << node_count) - 1;
+            return syscall(SYS_set_mempolicy, mpol_interleave, &mask, sizeof(mask) * 8) == 0;
+        }
+
+        bool prefer(int node) {
+            unsigned long mask = 1UL << node;
+            return syscall(SYS_set_mempolicy, mpol_preferred, &mask, sizeof(mask) * 8) == 0;
+        }
+
+        void reset() {
+            syscall(SYS_set_mempolicy, mpol_default, NULL, 0);
+        }
+};
+
+#endif
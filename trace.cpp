@@ -0,0 +1,170 @@
+#ifndef TRACE_CPP
+#define TRACE_CPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Workload trace file. The layout is columnar so a mapped file can be read in place as plain arrays:
+//
+//   header | ops (count bytes, padded to 8) | keys (count x int64) | times (count x uint64 ns, optional)
+//
+// Ops use the driver's codes: 'a' add, 'r' remove, 'c' contains. Times are offsets from the start of the capture.
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+static const char trace_magic[8] = {'H', 'S', 'T', 'R', 'A', 'C', 'E', '\0'};
+static const uint32_t trace_version = 1;
+static const uint32_t trace_timed = 1;
+
+// Read-only view of a workload. Either points into vectors the driver generated or into a mapped trace file; workers
+// don't need to know which.
+struct workload {
+    const char* ops;
+    const int64_t* keys;
+
+    // NULL unless the workload carries arrival times
+    const uint64_t* times;
+
+    long count;
+
+    workload() {
+        ops = NULL;
+        keys = NULL;
+        times = NULL;
+        count = 0;
+    }
+};
+
+class trace {
+
+    private:
+
+        int fd;
+        void* base;
+        size_t length;
+
+        static size_t ops_bytes(uint64_t count) {
+            return (count + 7) & ~(uint64_t) 7;
+        }
+
+    public:
+
+        trace() {
+            fd = -1;
+            base = MAP_FAILED;
+            length = 0;
+        }
+
+        ~trace() {
+            close();
+        }
+
+        // Write a workload out in one pass. Returns false on any I/O error.
+        static bool write(const std::string& path, const workload& w) {
+            FILE* out = fopen(path.c_str(), "wb");
+            if (!out) {
+                return false;
+            }
+
+            trace_header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, trace_magic, sizeof(header.magic));
+            header.version = trace_version;
+            header.flags = w.times ? trace_timed : 0;
+            header.count = w.count;
+
+            static const char padding[8] = {0};
+
+            bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+            ok = ok && fwrite(w.ops, 1, w.count, out) == (size_t) w.count;
+            ok = ok && fwrite(padding, 1, ops_bytes(w.count) - w.count, out) == ops_bytes(w.count) - w.count;
+            ok = ok && fwrite(w.keys, sizeof(int64_t), w.count, out) == (size_t) w.count;
+
+            if (w.times) {
+                ok = ok && fwrite(w.times, sizeof(uint64_t), w.count, out) == (size_t) w.count;
+            }
+
+            return fclose(out) == 0 && ok;
+        }
+
+        // Map a trace file read-only and point <w> at its columns. Returns false with a reason in <error> if the file
+        // can't be mapped or isn't a trace.
+        bool open(const std::string& path, workload& w, std::string& error) {
+            close();
+
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                error = "can't open " + path;
+                return false;
+            }
+
+            struct stat info;
+            if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(trace_header)) {
+                error = path + " is too short to be a trace";
+                return false;
+            }
+
+            length = info.st_size;
+            base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (base == MAP_FAILED) {
+                error = "can't map " + path;
+                return false;
+            }
+
+            const trace_header* header = (const trace_header*) base;
+            if (memcmp(header->magic, trace_magic, sizeof(trace_magic)) != 0 || header->version != trace_version) {
+                error = path + " is not a version " + std::to_string(trace_version) + " trace";
+                return false;
+            }
+
+            // Bound count by what the file can hold before any arithmetic on it, so a corrupt header can't wrap the
+            // expected size around to something small
+            bool timed = header->flags & trace_timed;
+            size_t per_op = sizeof(int64_t) * (timed ? 2 : 1);
+            size_t body = length - sizeof(trace_header);
+            if (header->count > body / per_op ||
+                    ops_bytes(header->count) + header->count * per_op > body) {
+                error = path + " is truncated";
+                return false;
+            }
+
+            // Workers stream through their partitions front to back
+            madvise(base, length, MADV_SEQUENTIAL);
+
+            const char* column = (const char*) base + sizeof(trace_header);
+
+            w.count = header->count;
+            w.ops = column;
+            w.keys = (const int64_t*) (column + ops_bytes(header->count));
+            w.times = timed ? (const uint64_t*) (column + ops_bytes(header->count) + header->count * sizeof(int64_t)) : NULL;
+
+            return true;
+        }
+
+        void close() {
+            if (base != MAP_FAILED) {
+                munmap(base, length);
+                base = MAP_FAILED;
+            }
+
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+};
+
+#endif
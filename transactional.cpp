@@ -3,10 +3,14 @@
 #include <iostream>
 #include <shared_mutex>
 #include <mutex>
+#include <algorithm>
 
 #include "set.h"
 
-template <typename T> class transactional_set: public set<T> {
+// D is the number of tables and hash functions, see sequential_set
+template <typename T, int D = 2> class transactional_set: public set<T> {
+
+    static_assert(D >= 2, "cuckoo hashing needs at least two tables");
 
     // Hashset entry holds both the value and a flag to determine if the entry currently holds a value. By default this flag is false.
     struct entry {
@@ -14,109 +18,189 @@ template <typename T> class transactional_set: public set<T> {
         bool has_value;
     };
 
+    // Values are counted in shards by primary bucket, so transactions adding to different shards don't conflict on
+    // one counter. Each shard has its own cache line for the same reason.
+    static constexpr int shards = 64;
+
+    struct alignas(64) shard_count {
+        size_t values = 0;
+    };
+
     private:
 
         // Current size of the hashset
-        int set_size;
+        size_t set_size;
 
         // The maximum amount of tries we should attempt before resizing the table
         int limit;
 
-        int probe_size = 4;
-        int threshold = 2;
+        // Capacity of each bucket, and the occupancy above which an insertion relocates values out of its bucket
+        int probe_size;
+        int threshold;
 
         // Tables which correspond to their appropriate hash functions
-        std::vector<std::vector<T>> tables[2];
+        std::vector<std::vector<T>> tables[D];
+
+        shard_count filled[shards];
+
+        // Held shared by single operations and exclusively by group operations and by resizes the caller asks for, see
+        // add_all()
+        std::shared_mutex grouping;
+
+#ifdef SET_STATS
+        set_counters counters;
+#endif
 
         // Primary table
-        int hash0(int value) {
-            return value % set_size;
+        size_t hash0(T value) {
+            return (uint64_t) value % set_size;
+        }
+
+        // Hash function for table k, table 0 uses the primary hash and the others a per-table mix
+        size_t hash(int k, T value) {
+            if (k == 0) {
+                return hash0(value);
+            }
+
+            return set<T>::mix((uint64_t) value + (k - 1) * 0x9e3779b97f4a7c15ull) % set_size;
+        }
+
+        // Bucket index of <value> in every table, headers and then values prefetched so the D probes overlap
+        void candidates(T value, size_t* index) {
+            for(int k = 0; k < D; k++) {
+                index[k] = hash(k, value);
+                __builtin_prefetch(&tables[k][index[k]]);
+            }
+
+            for(int k = 0; k < D; k++) {
+                __builtin_prefetch(tables[k][index[k]].data());
+            }
+        }
+
+        // Called from inside transactions, insert() and erase() count under the same transaction as the bucket change
+        shard_count& shard(T value) {
+            return filled[hash0(value) % shards];
+        }
+
+        size_t counted() {
+            size_t count = 0;
+            for(int i = 0; i < shards; i++) {
+                count += filled[i].values;
+            }
+
+            return count;
         }
 
-        // Secondary table, same function plus an offset
-        int hash1(int value) {
-            uint x = value;
-            x = ((x >> 16) ^ x) * 0x45d9f3b;
-            x = ((x >> 16) ^ x) * 0x45d9f3b;
-            x = (x >> 16) ^ x;
-            return x % set_size;
-        }       
+        // Whether the set has passed the policy's maximum load, totalling the shards only once <value>'s is past its
+        // share, see concurrent_set
+        bool full(T value) {
+            if (set<T>::growth.max_load >= 1) {
+                return false;
+            }
+
+            double limit = set<T>::growth.max_load * D * set_size * probe_size;
+            return shard(value).values > limit / shards && counted() > limit;
+        }
 
+        // Grow to <size_new> buckets, or one step under the growth policy when 0
         __attribute__ ((transaction_pure))
-        void resize() {
+        void resize(size_t size_new = 0) {
             __transaction_atomic {
-                // Track the old size, double the current
-                int size_old = set_size;
+                size_t size_old = set_size;
 
-                if (size_old != set_size) {
-                    // We didn't acquire locks in time
+                if (size_new == 0) {
+                    size_new = set<T>::growth.next(size_old);
+                }
+                else if (size_new <= size_old) {
                     return;
                 }
 
-                std::vector<std::vector<T>> table0_old = tables[0];
-                std::vector<std::vector<T>> table1_old = tables[1];
+#ifdef SET_STATS
+                uint64_t started = set_counters::now();
+#endif
 
-                set_size = size_old * 2;
+                std::vector<std::vector<T>> tables_old[D];
 
-                tables[0] = std::vector<std::vector<T>>(set_size);
-                tables[1] = std::vector<std::vector<T>>(set_size);
+                set_size = size_new;
 
-                for(int i = 0; i < set_size; i++) {
-                    tables[0].push_back(std::vector<T>(probe_size));
-                    tables[1].push_back(std::vector<T>(probe_size));
+                // Values move to new shards, the adds below count them again
+                for(int i = 0; i < shards; i++) {
+                    filled[i].values = 0;
                 }
 
-                // Copy over the old entries, but only the ones that had values
-                for(int i = 0; i < size_old; i++) {
-                    for (auto it = table0_old[i].begin(); it != table0_old[i].end(); ++it) {
-                        add(*it);
+                for(int k = 0; k < D; k++) {
+                    tables_old[k] = tables[k];
+                    tables[k] = std::vector<std::vector<T>>(set_size);
+
+                    for(size_t i = 0; i < set_size; i++) {
+                        tables[k][i].reserve(probe_size);
                     }
+                }
 
-                    for (auto it = table1_old[i].begin(); it != table1_old[i].end(); ++it) {
-                        add(*it);
+                // Copy over the old entries, but only the ones that had values
+                for(int k = 0; k < D; k++) {
+                    for(size_t i = 0; i < size_old; i++) {
+                        for (auto it = tables_old[k][i].begin(); it != tables_old[k][i].end(); ++it) {
+                            insert(*it);
+                        }
                     }
                 }
+
+#ifdef SET_STATS
+                counters.resize(set_counters::now() - started);
+#endif
             }
         }
 
         __attribute__ ((transaction_pure))
-        bool relocate(int i, int hi) {
+        bool relocate(int i, size_t hi) {
             __transaction_atomic {
-                int j = 1 - i;
-                int hj = 0;
+                int j = 0;
+                size_t hj = 0;
+
+                int path = 0;
 
                 for (int round = 0; round < limit; round++) {
                     T val = tables[i][hi].at(0);
 
-                    if (i) {
-                        hj = hash0(val);
-                    }
-                    else {
-                        hj = hash1(val);
+                    // Move the value to the least loaded of its buckets in the other tables
+                    j = -1;
+                    for(int t = 0; t < D; t++) {
+                        if (t != i && (j < 0 || tables[t][hash(t, val)].size() < tables[j][hj].size())) {
+                            j = t;
+                            hj = hash(t, val);
+                        }
                     }
 
-                    bool removed;
-                    for (int i = 0; i < tables[i][hi].size(); ++i) {
-                        if (tables[i][hi].at(i) == val) {
-                            tables[i][hi].erase(tables[i][hi].begin() + i);
+                    bool removed = false;
+                    for (size_t k = 0; k < tables[i][hi].size(); ++k) {
+                        if (tables[i][hi].at(k) == val) {
+                            tables[i][hi].erase(tables[i][hi].begin() + k);
                             removed = true;
                             break;
                         }
                     }
 
                     if (removed) {
+                        path++;
+
                         if (tables[j][hj].size() < threshold) {
                             tables[j][hj].push_back(val);
+#ifdef SET_STATS
+                            counters.path(path);
+#endif
                             return true;
                         }
                         else if (tables[j][hj].size() < probe_size) {
                             tables[j][hj].push_back(val);
-                            i = 1 - i;
+                            i = j;
                             hi = hj;
-                            j = 1 - j;
                         }
                         else {
                             tables[i][hi].push_back(val);
+#ifdef SET_STATS
+                            counters.path(path);
+#endif
                             return false;
                         }
                     }
@@ -124,17 +208,23 @@ template <typename T> class transactional_set: public set<T> {
                         continue;
                     }
                     else {
+#ifdef SET_STATS
+                        counters.path(path);
+#endif
                         return true;
                     }
                 }
 
+#ifdef SET_STATS
+                counters.path(path);
+#endif
                 return false;
             }
 
         }
 
         // Swap a new entry, return the old one
-        entry swap(entry* table, T value, int index) {
+        entry swap(entry* table, T value, size_t index) {
             entry entry_old = table[index];
 
             table[index].value = value;
@@ -145,138 +235,346 @@ template <typename T> class transactional_set: public set<T> {
 
     public:
 
-        transactional_set(int size, int limit) {
+        transactional_set(size_t size, int limit, int probe_size = 4, int threshold = 2) {
             this->set_size = size;
             this->limit = limit;
+            this->probe_size = probe_size;
+            this->threshold = threshold;
 
-            tables[0] = std::vector<std::vector<T>>(size);
-            tables[1] = std::vector<std::vector<T>>(size);
+            for(int k = 0; k < D; k++) {
+                tables[k] = std::vector<std::vector<T>>(size);
 
-            for(int i = 0; i < set_size; i++) {
-                tables[0].push_back(std::vector<T>(probe_size));
-                tables[1].push_back(std::vector<T>(probe_size));
+                // Buckets start empty, with room for probe_size values
+                for(size_t i = 0; i < set_size; i++) {
+                    tables[k][i].reserve(probe_size);
+                }
             }
         }
 
-        __attribute__ ((transaction_pure))
         bool add(T value) {
-            __transaction_atomic {
-                // If the table already contains the value return false
-                if (contains(value)) {
-                    return false;
-                }
+            std::shared_lock<std::shared_mutex> held(grouping);
+            return insert(value);
+        }
 
-                int index0 = hash0(value);
-                int index1 = hash1(value);
+        bool remove(T value) {
+            std::shared_lock<std::shared_mutex> held(grouping);
+            return erase(value);
+        }
 
-                bool to_resize = false;
+        bool contains(T value) {
+            std::shared_lock<std::shared_mutex> held(grouping);
+            return find(value);
+        }
 
-                int table_index = -1;
-                int hash_index = -1;
+        // Group operations take <grouping> exclusively, so no single operation or other group runs while one is part
+        // way through. A transaction per group doesn't give that here: the bodies are transaction_pure, so their
+        // container calls aren't instrumented and another transaction could see or overwrite a half-applied group.
+        size_t add_all(const T* values, size_t count) {
+            std::unique_lock<std::shared_mutex> held(grouping);
 
-                if (tables[0][index0].size() < threshold) {
-                    tables[0][index0].push_back(value);
-                    return true;
-                }
-                else if (tables[1][index1].size() < threshold) {
-                    tables[1][index1].push_back(value);
-                    return true;
-                }
-                else if (tables[0][index0].size() < probe_size) {
-                    tables[0][index0].push_back(value);
-                    table_index = 0;
-                    hash_index = index0;
-                }
-                else if (tables[1][index1].size() < probe_size) {
-                    tables[1][index1].push_back(value);
-                    table_index = 1;
-                    hash_index = index1;
-                }
-                else {
-                    to_resize = true;
-                }
-                
-                if (to_resize) {
-                    resize();
-                    add(value);
+            size_t added = 0;
+            for(size_t i = 0; i < count; i++) {
+                added += insert(values[i]);
+            }
+
+            return added;
+        }
+
+        size_t remove_all(const T* values, size_t count) {
+            std::unique_lock<std::shared_mutex> held(grouping);
+
+            size_t removed = 0;
+            for(size_t i = 0; i < count; i++) {
+                removed += erase(values[i]);
+            }
+
+            return removed;
+        }
+
+        bool replace(T from, T to) {
+            std::unique_lock<std::shared_mutex> held(grouping);
+
+            if (find(to) || !erase(from)) {
+                return false;
+            }
+
+            insert(to);
+            return true;
+        }
+
+        // No prefetching here: the bucket addresses can only be worked out inside a transaction, which would have to
+        // span the whole batch. Each value is looked up in its own.
+        void contains_batch(const T* values, size_t count, bool* found) {
+            for(size_t i = 0; i < count; i++) {
+                found[i] = contains(values[i]);
+            }
+        }
+
+        // Adds the values partition by partition, so the primary table is written one cache-sized stretch at a time.
+        // Each value is still its own transaction: insert() is transaction_pure, so an enclosing transaction that
+        // aborted would not roll back the values it had already inserted.
+        size_t insert_batch(const T* values, size_t count) {
+            std::vector<T> sorted;
+            std::vector<size_t> bounds;
+
+            size_t span = std::max((size_t) 1, set<T>::chunk_bytes / (sizeof(std::vector<T>) + probe_size * sizeof(T)));
+            // The runs are planned against one reading of the size, a resize meanwhile only makes them less local
+            size_t size = set_size;
+            set<T>::partition(values, count, size, span, [size](T value) { return (uint64_t) value % size; }, sorted, bounds);
+
+            size_t added = 0;
+            for(size_t i = 0; i < count; i++) {
+                added += add(sorted[i]);
+            }
+
+            return added;
+        }
+
+        size_t size() {
+            size_t count = 0;
+            
+            // Iterate over all tables, add to count whenever we hit an element
+            for(int k = 0; k < D; k++) {
+                for(size_t i = 0; i < set_size; i++) {
+                    count += tables[k][i].size();
                 }
-                else if (!relocate(table_index, hash_index)) {
-                    resize();
+            }
+
+            return count;
+        }
+
+        // Generate random values until we've inserted pop items
+        void populate(size_t pop, T (*random_t)()) {
+            for(size_t i = 0; i < pop; i++) {
+                while(!add(random_t()));
+            }
+        }
+
+        set_stats stats() {
+            set_stats s;
+            size_t count = 0;
+
+            s.occupancy = std::vector<uint64_t>(probe_size + 1);
+            for(int t = 0; t < D; t++) {
+                for(size_t i = 0; i < set_size; i++) {
+                    size_t held = tables[t][i].size();
+
+                    if (held >= s.occupancy.size()) {
+                        s.occupancy.resize(held + 1);
+                    }
+
+                    s.occupancy[held]++;
+                    count += held;
                 }
+            }
+
+            s.capacity = D * set_size * probe_size;
+            s.load_factor = (double) count / s.capacity;
+
+#ifdef SET_STATS
+            counters.fill(s);
+#endif
+
+            return s;
+        }
 
-                return true;
+        size_t memory_usage() {
+            size_t bytes = sizeof(*this);
+
+            for(int t = 0; t < D; t++) {
+                bytes += tables[t].capacity() * sizeof(std::vector<T>);
+
+                for (auto& bucket : tables[t]) {
+                    bytes += bucket.capacity() * sizeof(T);
+                }
             }
+
+            return bytes;
+        }
+
+        // Plans for buckets filled up to the threshold, see concurrent_set. Like the group operations, reserve() and
+        // grow() hold <grouping> exclusively so a resize never lands part way through a group.
+        void reserve(size_t count) {
+            std::unique_lock<std::shared_mutex> held(grouping);
+
+            double load = std::min(set<T>::growth.max_load, (double) threshold / probe_size);
+            resize(set<T>::buckets_for(count, load, D * probe_size));
         }
 
         __attribute__ ((transaction_pure))
-        bool remove(T value){
+        bool grow() {
+            std::unique_lock<std::shared_mutex> held(grouping);
+            bool grow = false;
+
             __transaction_atomic {
-                // Check if the value is in table0, if so, remove it
-                int index0 = hash0(value);
+                grow = set<T>::growth.idle_load > 0 && counted() > set<T>::growth.idle_load * D * set_size * probe_size;
+            }
 
-                for (auto it = tables[0][index0].begin(); it != tables[0][index0].end(); ++it) {
-                    if (*it == value) {
-                        tables[0][index0].erase(it);
-                        return true;
-                    }
-                }
+            if (grow) {
+                resize();
+            }
 
-                // Perform the same check for table1
-                int index1 = hash1(value);
-                
-                for (auto it = tables[1][index1].begin(); it != tables[1][index1].end(); ++it) {
-                    if (*it == value) {
-                        tables[1][index1].erase(it);
-                        return true;
-                    }
+            return grow;
+        }
+
+        size_t buckets() {
+            return set_size;
+        }
+
+        void for_each_range(size_t begin, size_t end, const std::function<void(T)>& fn) {
+            std::vector<T> slot;
+
+            for(size_t i = begin; i < end; i++) {
+                // Copy the slot out in its own transaction and call fn outside of it
+                copy_slot(i, slot);
+
+                for (T value : slot) {
+                    fn(value);
                 }
-                
-                return false;
             }
         }
 
+    private:
+
+        // The single operations, without <grouping>. Each result is set inside the transaction and returned once it
+        // has committed, which is when the commit counter goes out of scope in a STATS build.
         __attribute__ ((transaction_pure))
-        bool contains(T value){
+        bool insert(T value) {
+            bool added;
+
+#ifdef SET_STATS
+            set_counters::committed commit(counters);
+#endif
             __transaction_atomic {
-                // Check if the value is in table0
-                int index0 = hash0(value);
+#ifdef SET_STATS
+                commit.attempt();
+#endif
+                // If the table already contains the value return false
+                added = !find(value);
 
-                for (auto it = tables[0][index0].begin(); it != tables[0][index0].end(); ++it) {
-                    if (*it == value) {
-                        return true;
+                if (added) {
+                    if (full(value)) {
+                        resize();
+                    }
+
+                    size_t index[D];
+                    for(int k = 0; k < D; k++) {
+                        index[k] = hash(k, value);
+                    }
+
+                    bool placed = false;
+
+                    // Any bucket under the threshold takes the value outright
+                    for(int k = 0; k < D && !placed; k++) {
+                        if (tables[k][index[k]].size() < threshold) {
+                            tables[k][index[k]].push_back(value);
+                            shard(value).values++;
+                            placed = true;
+#ifdef SET_STATS
+                            counters.path(0);
+#endif
+                        }
+                    }
+
+                    if (!placed) {
+                        bool to_resize = true;
+
+                        int table_index = -1;
+                        size_t hash_index = 0;
+
+                        // Otherwise the first with room takes it and gets relocated back under the threshold
+                        for(int k = 0; k < D; k++) {
+                            if (tables[k][index[k]].size() < probe_size) {
+                                tables[k][index[k]].push_back(value);
+                                shard(value).values++;
+                                table_index = k;
+                                hash_index = index[k];
+                                to_resize = false;
+                                break;
+                            }
+                        }
+
+                        if (to_resize) {
+                            resize();
+                            insert(value);
+                        }
+                        else if (!relocate(table_index, hash_index)) {
+                            resize();
+                        }
                     }
                 }
+            }
 
-                // Perform the same check for table1
-                int index1 = hash1(value);
+            return added;
+        }
 
-                for (auto it = tables[1][index1].begin(); it != tables[1][index1].end(); ++it) {
-                    if (*it == value) {
-                        return true;
+        __attribute__ ((transaction_pure))
+        bool erase(T value) {
+            bool removed;
+
+#ifdef SET_STATS
+            set_counters::committed commit(counters);
+#endif
+            __transaction_atomic {
+#ifdef SET_STATS
+                commit.attempt();
+#endif
+                size_t index[D];
+                candidates(value, index);
+
+                removed = false;
+
+                // Check if the value is in any of the tables, if so, remove it
+                for(int k = 0; k < D && !removed; k++) {
+                    for (auto it = tables[k][index[k]].begin(); it != tables[k][index[k]].end(); ++it) {
+                        if (*it == value) {
+                            tables[k][index[k]].erase(it);
+                            shard(value).values--;
+                            removed = true;
+                            break;
+                        }
                     }
                 }
-                
-                return false;
             }
+
+            return removed;
         }
 
-        int size() {
-            int count = 0;
-            
-            // Iterate over both tables, add to count whenever we hit an element
-            for(int i = 0; i < set_size; i++) {
-                count += tables[0][i].size();
+        __attribute__ ((transaction_pure))
+        bool find(T value) {
+            bool found;
+
+#ifdef SET_STATS
+            set_counters::committed commit(counters);
+#endif
+            __transaction_atomic {
+#ifdef SET_STATS
+                commit.attempt();
+#endif
+                size_t index[D];
+                candidates(value, index);
+
+                found = false;
 
-                count += tables[1][i].size();
+                // Check if the value is in any of the tables
+                for(int k = 0; k < D && !found; k++) {
+                    found = std::find(tables[k][index[k]].begin(), tables[k][index[k]].end(), value) != tables[k][index[k]].end();
+                }
             }
 
-            return count;
+            return found;
         }
 
-        // Generate random values until we've inserted pop items
-        void populate(int pop, T (*random_t)()) {
-            for(int i = 0; i < pop; i++) {
-                while(!add(random_t()));
+        __attribute__ ((transaction_pure))
+        void copy_slot(size_t i, std::vector<T>& slot) {
+            __transaction_atomic {
+                slot.clear();
+
+                if (i < set_size) {
+                    for(int k = 0; k < D; k++) {
+                        slot.insert(slot.end(), tables[k][i].begin(), tables[k][i].end());
+                    }
+                }
             }
         }
 };
\ No newline at end of file